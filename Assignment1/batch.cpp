@@ -0,0 +1,534 @@
+// batch.cpp
+//
+// Headless batch editing: apply one edit script to every image in a
+// directory and write the results to another directory.
+//
+//   batch <script> <input dir> <output dir> [options]
+//
+//   -k nearest|bilinear|bicubic|lanczos   interpolation (default bilinear)
+//   -f                                    forward instead of backward projection
+//   -x                                    16.16 fixed-point warp (nearest and bilinear)
+//   -l <n>                                loader threads (default 2)
+//   -e <n>                                encoder threads (default 2)
+//
+// Images are binary PPM (P6) or PAM (P7, RGB or RGB_ALPHA) files.  Each
+// output has the input's name and format; PPM output drops alpha, so
+// transparent areas come out black.
+//
+// The script has one edit per line, applied in order as in the editor:
+//
+//   translate <dx> <dy>            in pixels
+//   rotate <degrees>               about the image centre
+//   scale <factor> [<factor y>]    about the image centre
+//   intensity <contrast> <brightness>   l -> contrast * l + brightness
+//   matrix <a> <b> <c> <d> <e> <f>      replace the transform so far with
+//                                       (x,y) -> (ax+by+c, dx+ey+f), e.g. a
+//                                       saved 'accumulatedTransform'
+//
+// Blank lines and lines starting with '#' are ignored.
+//
+// Loading, warping and encoding run as a pipeline: loader threads
+// decode images into a bounded queue, the warp stage projects them
+// with a headless Editor (which spreads each image over its thread
+// pool), and encoder threads write them out.  The stages overlap, so
+// disk and decode time are hidden behind the warp.
+//
+// This has its own main(), so it is built as a separate program from
+// the interactive editor, e.g.
+//
+//   g++ -O2 -pthread batch.cpp editor.cpp -o batch
+
+
+#include "editor.h"
+
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+
+#include <dirent.h>
+
+
+// A decoded image and where it goes
+
+class BatchImage {
+
+ public:
+
+  string inPath, outPath;
+  int width, height;
+  bool hasAlpha;               // PAM with RGB_ALPHA
+  bool pam;                    // write as PAM rather than PPM
+  vector<Pixel> pixels;        // row-major
+};
+
+
+// A queue between pipeline stages.  put() blocks while the queue is
+// full, so a fast stage cannot run arbitrarily far ahead and fill
+// memory.  get() returns false once the queue is closed and empty.
+
+template <class T>
+class BoundedQueue {
+
+  deque<T> items;
+  unsigned int capacity;
+  bool closed;
+
+  mutex lock;
+  condition_variable notFull, notEmpty;
+
+ public:
+
+  BoundedQueue( unsigned int cap ) {
+    capacity = cap;
+    closed = false;
+  }
+
+  void put( T item ) {
+    unique_lock<mutex> l( lock );
+    notFull.wait( l, [&]{ return items.size() < capacity; } );
+    items.push_back( item );
+    notEmpty.notify_one();
+  }
+
+  bool get( T &item ) {
+    unique_lock<mutex> l( lock );
+    notEmpty.wait( l, [&]{ return !items.empty() || closed; } );
+    if (items.empty())
+      return false;
+    item = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    lock_guard<mutex> l( lock );
+    closed = true;
+    notEmpty.notify_all();
+  }
+};
+
+
+
+// PPM / PAM input and output
+
+
+static string nextToken( istream &in )
+
+{
+  string token;
+
+  while (in >> token) {
+    if (token[0] != '#')
+      return token;
+    getline( in, token ); // skip the rest of a comment
+  }
+
+  return "";
+}
+
+
+static bool readImage( BatchImage &img )
+
+{
+  ifstream in( img.inPath.c_str(), ios::binary );
+
+  if (!in)
+    return false;
+
+  string magic = nextToken( in );
+  int maxVal = 0;
+  int depth = 3;
+
+  if (magic == "P6") {
+
+    img.width  = atoi( nextToken( in ).c_str() );
+    img.height = atoi( nextToken( in ).c_str() );
+    maxVal     = atoi( nextToken( in ).c_str() );
+    img.pam = false;
+
+  } else if (magic == "P7") {
+
+    string key;
+    while ((key = nextToken( in )) != "ENDHDR" && key != "") {
+      if (key == "WIDTH")       img.width  = atoi( nextToken( in ).c_str() );
+      else if (key == "HEIGHT") img.height = atoi( nextToken( in ).c_str() );
+      else if (key == "DEPTH")  depth      = atoi( nextToken( in ).c_str() );
+      else if (key == "MAXVAL") maxVal     = atoi( nextToken( in ).c_str() );
+      else                      nextToken( in ); // TUPLTYPE
+    }
+    img.pam = true;
+
+  } else
+    return false;
+
+  if (maxVal != 255 || (depth != 3 && depth != 4) || img.width <= 0 || img.height <= 0)
+    return false;
+
+  in.get(); // the single whitespace character before the raster
+
+  img.hasAlpha = (depth == 4);
+  img.pixels.resize( img.width * (size_t) img.height );
+
+  vector<unsigned char> row( img.width * depth );
+
+  for (int y=0; y<img.height; y++) {
+
+    if (!in.read( (char *) row.data(), row.size() ))
+      return false;
+
+    Pixel *out = &img.pixels[ y * (size_t) img.width ];
+
+    for (int x=0; x<img.width; x++) {
+      unsigned char *p = &row[ x * depth ];
+      out[x].r = p[0];
+      out[x].g = p[1];
+      out[x].b = p[2];
+      out[x].a = (depth == 4) ? p[3] : 255;
+    }
+  }
+
+  return true;
+}
+
+
+static bool writeImage( BatchImage &img )
+
+{
+  ofstream out( img.outPath.c_str(), ios::binary );
+
+  if (!out)
+    return false;
+
+  // The warp leaves uncovered pixels transparent, so PAM output keeps
+  // alpha even if the input had none
+
+  int depth = img.pam ? 4 : 3;
+
+  if (img.pam)
+    out << "P7\nWIDTH " << img.width << "\nHEIGHT " << img.height
+        << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+  else
+    out << "P6\n" << img.width << " " << img.height << "\n255\n";
+
+  vector<unsigned char> row( img.width * depth );
+
+  for (int y=0; y<img.height; y++) {
+
+    Pixel *in = &img.pixels[ y * (size_t) img.width ];
+
+    for (int x=0; x<img.width; x++) {
+      unsigned char *p = &row[ x * depth ];
+      bool clear = (in[x].a == 0);
+      p[0] = clear ? 0 : in[x].r;
+      p[1] = clear ? 0 : in[x].g;
+      p[2] = clear ? 0 : in[x].b;
+      if (depth == 4)
+        p[3] = in[x].a;
+    }
+
+    out.write( (char *) row.data(), row.size() );
+  }
+
+  return (bool) out;
+}
+
+
+
+// An edit script, as described at the top
+
+
+class ScriptOp {
+
+ public:
+
+  string name;
+  vector<float> args;
+};
+
+
+static bool readScript( const char *path, vector<ScriptOp> &ops )
+
+{
+  ifstream in( path );
+
+  if (!in) {
+    cerr << "can't read script " << path << endl;
+    return false;
+  }
+
+  string line;
+  int lineNum = 0;
+
+  while (getline( in, line )) {
+
+    lineNum++;
+
+    istringstream words( line );
+    ScriptOp op;
+
+    if (!(words >> op.name) || op.name[0] == '#')
+      continue;
+
+    float v;
+    while (words >> v)
+      op.args.push_back( v );
+
+    unsigned int n = op.args.size();
+
+    bool ok = (op.name == "translate" && n == 2) ||
+              (op.name == "rotate"    && n == 1) ||
+              (op.name == "scale"     && (n == 1 || n == 2)) ||
+              (op.name == "intensity" && n == 2) ||
+              (op.name == "matrix"    && n == 6);
+
+    if (!ok) {
+      cerr << path << ":" << lineNum << ": can't understand '" << line << "'" << endl;
+      return false;
+    }
+
+    ops.push_back( op );
+  }
+
+  return true;
+}
+
+
+// The 4x4 matrix of (x,y) -> (ax+by+c, dx+ey+f).
+//
+// It is built from translate(), rotate() and scale() alone, with the
+// 2x2 part written as rotate * scale * rotate by the closed-form 2x2
+// SVD.  A reflection shows up as a negative second scale factor.
+
+static mat4 affineMatrix( vector<float> &m )
+
+{
+  float a = m[0], b = m[1], c = m[2];
+  float d = m[3], e = m[4], f = m[5];
+
+  float E = (a + e) / 2, F = (a - e) / 2;
+  float G = (d + b) / 2, H = (d - b) / 2;
+
+  float Q = sqrtf( E*E + H*H );
+  float R = sqrtf( F*F + G*G );
+
+  float a1 = atan2f( G, F );
+  float a2 = atan2f( H, E );
+
+  float theta = (a2 - a1) / 2;
+  float phi   = (a2 + a1) / 2;
+
+  return translate( c, f, 0 ) * rotate( phi, vec3(0,0,1) ) * scale( Q + R, Q - R, 1 ) * rotate( theta, vec3(0,0,1) );
+}
+
+
+// The transform and tone curve of the script for a w x h image.  As in
+// the editor, each edit is multiplied onto the left of the transform
+// so far.
+
+static void compileScript( vector<ScriptOp> &ops, int w, int h, mat4 &T, ToneCurve &tone )
+
+{
+  mat4 toOrigin = translate( -w/2.0f, -h/2.0f, 0 );
+  mat4 back     = translate(  w/2.0f,  h/2.0f, 0 );
+
+  T = identity4();
+  tone = ToneCurve();
+
+  for (unsigned int i=0; i<ops.size(); i++) {
+
+    ScriptOp &op = ops[i];
+    mat4 M = identity4();
+
+    if (op.name == "translate")
+      M = translate( op.args[0], op.args[1], 0 );
+    else if (op.name == "rotate")
+      M = back * rotate( op.args[0] * M_PI / 180, vec3(0,0,1) ) * toOrigin;
+    else if (op.name == "scale")
+      M = back * scale( op.args[0], op.args.size() > 1 ? op.args[1] : op.args[0], 1 ) * toOrigin;
+    else if (op.name == "intensity")
+      tone = tone.adjusted( op.args[0], op.args[1] );
+    else if (op.name == "matrix")
+      T = affineMatrix( op.args );
+
+    T = M * T;
+  }
+}
+
+
+
+static void usage()
+
+{
+  cerr << "usage: batch <script> <input dir> <output dir> [-k nearest|bilinear|bicubic|lanczos] [-f] [-x]"
+       << " [-l loaders] [-e encoders]" << endl;
+  exit(1);
+}
+
+
+int main( int argc, char **argv )
+
+{
+  if (argc < 4)
+    usage();
+
+  const char *scriptPath = argv[1];
+  string inDir  = argv[2];
+  string outDir = argv[3];
+
+  Editor editor( NULL );
+
+  editor.projectionMode = BACKWARD;
+  editor.interpolationMode = BILINEAR;
+
+  int numLoaders = 2;
+  int numEncoders = 2;
+
+  for (int i=4; i<argc; i++) {
+    string opt = argv[i];
+    if (opt == "-k" && i+1 < argc) {
+      string k = argv[++i];
+      if (k == "nearest")       editor.interpolationMode = NEAREST;
+      else if (k == "bilinear") editor.interpolationMode = BILINEAR;
+      else if (k == "bicubic")  editor.interpolationMode = BICUBIC;
+      else if (k == "lanczos")  editor.interpolationMode = LANCZOS;
+      else usage();
+    } else if (opt == "-f")
+      editor.projectionMode = FORWARD;
+    else if (opt == "-x")
+      editor.warpArithmetic = FIXED_POINT;
+    else if (opt == "-l" && i+1 < argc)
+      numLoaders = max( atoi( argv[++i] ), 1 );
+    else if (opt == "-e" && i+1 < argc)
+      numEncoders = max( atoi( argv[++i] ), 1 );
+    else
+      usage();
+  }
+
+  vector<ScriptOp> script;
+
+  if (!readScript( scriptPath, script ))
+    exit(1);
+
+  // Find the images
+
+  vector<string> names;
+
+  DIR *dir = opendir( inDir.c_str() );
+  if (dir == NULL) {
+    cerr << "can't read directory " << inDir << endl;
+    exit(1);
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir( dir )) != NULL) {
+    string name = entry->d_name;
+    if (name.size() > 4) {
+      string ext = name.substr( name.size() - 4 );
+      if (ext == ".ppm" || ext == ".pam")
+        names.push_back( name );
+    }
+  }
+  closedir( dir );
+
+  sort( names.begin(), names.end() );
+
+  // Run the pipeline.  Queues hold a few images each, which bounds the
+  // memory in flight.
+
+  BoundedQueue<BatchImage *> loaded( 4 );
+  BoundedQueue<BatchImage *> warped( 4 );
+
+  atomic<int> nextName( 0 );
+  atomic<int> numFailed( 0 );
+  atomic<int> loadersLeft( numLoaders );
+
+  auto start = chrono::steady_clock::now();
+
+  vector<thread> loaders;
+  for (int i=0; i<numLoaders; i++)
+    loaders.push_back( thread( [&]() {
+      int n;
+      while ((n = nextName++) < (int) names.size()) {
+        BatchImage *img = new BatchImage();
+        img->inPath  = inDir + "/" + names[n];
+        img->outPath = outDir + "/" + names[n];
+        if (readImage( *img ))
+          loaded.put( img );
+        else {
+          cerr << "can't read " << img->inPath << endl;
+          numFailed++;
+          delete img;
+        }
+      }
+      if (--loadersLeft == 0)
+        loaded.close();
+    } ) );
+
+  vector<thread> encoders;
+  for (int i=0; i<numEncoders; i++)
+    encoders.push_back( thread( [&]() {
+      BatchImage *img;
+      while (warped.get( img )) {
+        if (!writeImage( *img )) {
+          cerr << "can't write " << img->outPath << endl;
+          numFailed++;
+        }
+        delete img;
+      }
+    } ) );
+
+  // Warp stage, on this thread and the editor's pool
+
+  double warpSeconds = 0;
+  int numWarped = 0;
+  BatchImage *img;
+
+  while (loaded.get( img )) {
+
+    mat4 T;
+    ToneCurve tone;
+    compileScript( script, img->width, img->height, T, tone );
+
+    BatchImage *result = new BatchImage();
+    result->outPath = img->outPath;
+    result->width = img->width;
+    result->height = img->height;
+    result->hasAlpha = img->hasAlpha;
+    result->pam = img->pam;
+    result->pixels.resize( img->pixels.size() );
+
+    auto warpStart = chrono::steady_clock::now();
+
+    editor.projectPixels( PixelView( img->pixels.data(), img->width, img->height ),
+                          PixelView( result->pixels.data(), result->width, result->height ), T, tone );
+
+    warpSeconds += chrono::duration<double>( chrono::steady_clock::now() - warpStart ).count();
+    numWarped++;
+
+    delete img;
+    warped.put( result );
+  }
+
+  warped.close();
+
+  for (unsigned int i=0; i<loaders.size(); i++)
+    loaders[i].join();
+  for (unsigned int i=0; i<encoders.size(); i++)
+    encoders[i].join();
+
+  double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+  cout << numWarped << " images in " << seconds << " s: " << numWarped / seconds << " images/s"
+       << " (warp " << warpSeconds << " s";
+  if (numWarped > 0)
+    cout << ", " << warpSeconds / numWarped * 1000 << " ms/image";
+  cout << ")" << endl;
+
+  if (numFailed > 0)
+    cout << numFailed << " images failed" << endl;
+
+  return (numFailed > 0) ? 1 : 0;
+}
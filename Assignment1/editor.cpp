@@ -3,82 +3,1312 @@
 
 #include "editor.h"
 
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+
+
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
 
 
 // Take the source image, apply the provided transform, T, and store
 // the transformed image in the destination image.
 //
-// Where a pixel in the destination image has no corresponding (valid)
-// pixel in the source image, use the 'transparentPixel'
+// Where a pixel in the destination image has no corresponding (valid)
+// pixel in the source image, use the 'transparentPixel'
+//
+// The destination is split into tileSize x tileSize tiles that are
+// processed in parallel on the thread pool.  Each tile is written only
+// by the task that owns it, in both projection modes, so no locking is
+// needed and a tile's rows stay in cache while it is being filled.
+//
+// The tone curve is applied to each tile right after it is projected,
+// while it is still in cache, so geometric and intensity edits cost a
+// single pass over the destination.
+//
+// When 'editedImage' is drawn, its mip pyramid is used in two ways:
+// backward projection of a minified image samples the level with
+// about one source pixel per destination pixel (so it is prefiltered
+// rather than aliased), and a preview renders the whole frame at
+// reduced resolution from a coarse level.
+//
+// project() renders synchronously with the current modes.  The
+// editor's own drawing goes through requestRender() instead, which
+// hands the frame to the render thread.
+
+
+void Editor::project( Texture *srcImage, Texture *destImage, mat4 &T, ToneCurve &tone )
+
+{
+  RenderSettings settings( projectionMode, interpolationMode, warpArithmetic, false );
+
+  render( srcImage, destImage, T, tone, settings );
+}
+
+
+
+// Render 'srcImage' into 'destImage' through T and the tone curve, as
+// described above, and return the rectangle of 'destImage' that was
+// rewritten.
+//
+// For 'backImage', only the part covered by the previous or the new
+// transformed image can change, since everything else is already
+// transparent, so just that rectangle is recomputed.
+
+DirtyRect Editor::render( Texture *srcImage, Texture *destImage, mat4 &T, ToneCurve &tone, RenderSettings &settings )
+
+{
+  // Check that dimensions match
+  
+  if (srcImage->width != destImage->width || srcImage->height != destImage->height) {
+    cerr << "in Editor::project() the source and destination images have different dimensions" << endl;
+    exit(1);
+  }
+
+  // Project
+
+  mat4 Tinv = T.inverse();
+
+  Affine2D srcToDest( T );
+  Affine2D destToSrc( Tinv );
+
+  bool usePyramid = (srcImage == editedImage);
+
+  if (usePyramid)
+    buildPyramid();
+
+  int previewLevel = (usePyramid && settings.preview) ? previewLevelFor( destImage ) : 0;
+
+  DirtyRect wholeImage( 0, 0, destImage->width, destImage->height );
+  DirtyRect region = wholeImage;
+  DirtyRect newFootprint = transformedBounds( srcImage->width, srcImage->height, destImage->width, destImage->height, T );
+
+  if (previewLevel > 0) { // preview blocks can overhang the footprint
+    int blockSize = 1 << previewLevel;
+    newFootprint = DirtyRect( newFootprint.x0 - blockSize, newFootprint.y0 - blockSize,
+                              newFootprint.x1 + blockSize, newFootprint.y1 + blockSize ).intersect( wholeImage );
+  }
+
+  if (destImage == backImage) {
+    region = footprint.unite( newFootprint );
+    footprint = newFootprint;
+  }
+
+  if (region.empty())
+    return region;
+
+  PixelView src( srcImage );
+  PixelView dest( destImage );
+
+  if (previewLevel > 0) {
+    renderPreview( dest, destToSrc, tone, region, previewLevel );
+    return region;
+  }
+
+  // Sample a minified image from the pyramid level that is closest to
+  // one source pixel per destination pixel
+
+  Affine2D warpMap = destToSrc;
+
+  if (usePyramid && settings.projection == BACKWARD) {
+    int level = levelForMinification( destToSrc.minification() );
+    if (level > 0) {
+      src = pyramidLevel( level );
+      warpMap = destToSrc.rescaled( 1, 1 << level );
+    }
+  }
+
+  renderTiles( src, dest, srcToDest, warpMap, tone, settings, region );
+
+  if (destImage != backImage)
+    destImage->updated = true; // necessary to get new image shipped to GPU
+
+  return region;
+}
+
+
+
+// Project 'region' of 'dest' from 'src', one tile per task, with the
+// tone curve applied to each tile as soon as it is drawn.  Tiles stay
+// aligned to the image so that they don't move as the region changes.
+
+void Editor::renderTiles( PixelView src, PixelView dest, Affine2D &srcToDest, Affine2D &destToSrc, ToneCurve &tone,
+                          RenderSettings &settings, DirtyRect &region )
+
+{
+  int tileX0 = region.x0 / tileSize;
+  int tileY0 = region.y0 / tileSize;
+  int tilesX = (region.x1 + tileSize-1) / tileSize - tileX0;
+  int tilesY = (region.y1 + tileSize-1) / tileSize - tileY0;
+
+  pool->parallelFor( tilesX * tilesY, [&]( int i ) {
+
+    if (cancelRender) // a preview has been requested, so this frame is stale
+      return;
+
+    int x0 = (tileX0 + i % tilesX) * tileSize;
+    int y0 = (tileY0 + i / tilesX) * tileSize;
+
+    DirtyRect tile( x0, y0, x0 + tileSize, y0 + tileSize );
+    tile = tile.intersect( region );
+
+    if (settings.projection == FORWARD)
+      projectForwardTile( src, dest, srcToDest, destToSrc, tile.x0, tile.y0, tile.x1, tile.y1 );
+    else
+      warpTile( src, dest, destToSrc, settings, tile.x0, tile.y0, tile.x1, tile.y1 );
+
+    for (int y=tile.y0; y<tile.y1; y++)
+      tone.apply( dest.row( y ) + tile.x0, tile.x1 - tile.x0 );
+  } );
+}
+
+
+
+// Project pixel buffers that don't belong to a Texture, such as images
+// loaded by a batch job.  The whole of 'dest' is drawn.
+
+void Editor::projectPixels( PixelView src, PixelView dest, mat4 &T, ToneCurve &tone )
+
+{
+  mat4 Tinv = T.inverse();
+
+  Affine2D srcToDest( T );
+  Affine2D destToSrc( Tinv );
+
+  RenderSettings settings( projectionMode, interpolationMode, warpArithmetic, false );
+  DirtyRect region( 0, 0, dest.width, dest.height );
+
+  renderTiles( src, dest, srcToDest, destToSrc, tone, settings, region );
+}
+
+
+
+// Build the mip pyramid of 'editedImage', if not already built.  The
+// edited image never changes, so this happens once.
+//
+// Each level halves the one below it (rounding up) with a 2x2 box
+// filter; a missing column or row at an odd-sized edge repeats the
+// last one.  Level 0 is 'editedImage' itself and is not copied.
+
+void Editor::buildPyramid()
+
+{
+  if (pyramidValid)
+    return;
+
+  pyramid.clear();
+
+  PixelView below( editedImage );
+
+  while ((below.width > 1 || below.height > 1) && pyramid.size() < maxPyramidLevels) {
+
+    pyramid.push_back( MipLevel( (below.width+1) / 2, (below.height+1) / 2 ) );
+
+    MipLevel &level = pyramid.back();
+    PixelView above( level.pixels.data(), level.width, level.height );
+
+    pool->parallelFor( above.height, [&]( int y ) {
+
+      Pixel *row0 = below.row( 2*y );
+      Pixel *row1 = below.row( MIN( 2*y+1, below.height-1 ) );
+      Pixel *out  = above.row( y );
+
+      for (int x=0; x<above.width; x++) {
+        int x0 = 2*x;
+        int x1 = MIN( 2*x+1, below.width-1 );
+        out[x].r = (row0[x0].r + row0[x1].r + row1[x0].r + row1[x1].r + 2) / 4;
+        out[x].g = (row0[x0].g + row0[x1].g + row1[x0].g + row1[x1].g + 2) / 4;
+        out[x].b = (row0[x0].b + row0[x1].b + row1[x0].b + row1[x1].b + 2) / 4;
+        out[x].a = (row0[x0].a + row0[x1].a + row1[x0].a + row1[x1].a + 2) / 4;
+      }
+    } );
+
+    below = above;
+  }
+
+  pyramidValid = true;
+}
+
+
+
+// Level 0 is 'editedImage'; level l > 0 is pyramid[l-1]
+
+PixelView Editor::pyramidLevel( int l )
+
+{
+  if (l == 0)
+    return PixelView( editedImage );
+
+  MipLevel &level = pyramid[l-1];
+  return PixelView( level.pixels.data(), level.width, level.height );
+}
+
+
+
+// The pyramid level with about one pixel per destination pixel, given
+// the number of source pixels per destination pixel
+
+int Editor::levelForMinification( float m )
+
+{
+  int level = 0;
+
+  while (m >= 2 && level < (int) pyramid.size()) {
+    m /= 2;
+    level++;
+  }
+
+  return level;
+}
+
+
+
+// The reduction, as a power of two, at which a preview of 'destImage'
+// fits in 'previewPixelBudget'
+
+int Editor::previewLevelFor( Texture *destImage )
+
+{
+  int level = 0;
+
+  while ((long) ((destImage->width  + (1<<level) - 1) >> level) *
+                ((destImage->height + (1<<level) - 1) >> level) > previewPixelBudget)
+    level++;
+
+  return level;
+}
+
+
+
+// Render 'region' of 'dest' at 1/2^level resolution: warp a coarse
+// pyramid level into a small preview buffer, then enlarge it into
+// 'dest' by pixel replication.  The cost of the warp is bounded by
+// 'previewPixelBudget' no matter how large the source image is.
+
+void Editor::renderPreview( PixelView dest, Affine2D &destToSrc, ToneCurve &tone, DirtyRect &region, int level )
+
+{
+  int blockSize = 1 << level;
+
+  int previewW = (dest.width  + blockSize-1) / blockSize;
+  int previewH = (dest.height + blockSize-1) / blockSize;
+
+  previewPixels.resize( previewW * previewH );
+  PixelView preview( previewPixels.data(), previewW, previewH );
+
+  // Map preview pixels to full-resolution source pixels, then to the
+  // pyramid level that matches the preview's sampling rate
+
+  Affine2D A = destToSrc.rescaled( blockSize, 1 );
+
+  int srcLevel = levelForMinification( A.minification() );
+  PixelView src = pyramidLevel( srcLevel );
+  A = A.rescaled( 1, 1 << srcLevel );
+
+  DirtyRect previewRegion( region.x0 / blockSize, region.y0 / blockSize,
+                           (region.x1 + blockSize-1) / blockSize, (region.y1 + blockSize-1) / blockSize );
+
+  pool->parallelFor( previewRegion.y1 - previewRegion.y0, [&]( int i ) {
+    int y = previewRegion.y0 + i;
+    warpBackwardTile( src, preview, A, BILINEAR, previewRegion.x0, y, previewRegion.x1, y+1 );
+    tone.apply( preview.row( y ) + previewRegion.x0, previewRegion.x1 - previewRegion.x0 );
+  } );
+
+  // Enlarge into the destination
+
+  pool->parallelFor( region.y1 - region.y0, [&]( int i ) {
+    int y = region.y0 + i;
+    Pixel *in  = preview.row( y / blockSize );
+    Pixel *out = dest.row( y );
+    for (int x=region.x0; x<region.x1; x++)
+      out[x] = in[ x / blockSize ];
+  } );
+}
+
+
+
+// Ask the render thread to draw 'editedImage' through T and 'tone'
+// (at reduced resolution if 'preview').  This returns at once.
+//
+// Only the latest request matters: one that is still waiting when a
+// newer one arrives is dropped.  A full-resolution frame in progress
+// is abandoned when a preview arrives, since the preview means that
+// the user is dragging again.
+
+void Editor::requestRender( mat4 &T, ToneCurve &tone, bool preview )
+
+{
+  lock_guard<mutex> l( renderLock );
+
+  stats.eventsPosted++;
+  if (requestPending)
+    stats.eventsCoalesced++;
+
+  pendingRequest.transform = T;
+  pendingRequest.tone = tone;
+  pendingRequest.settings = RenderSettings( projectionMode, interpolationMode, warpArithmetic, preview );
+  pendingRequest.posted = chrono::steady_clock::now();
+  requestPending = true;
+
+  if (rendering && !renderingPreview && preview)
+    cancelRender = true;
+
+  renderWake.notify_one();
+}
+
+
+
+// Block until the render thread has drawn every request
+
+void Editor::waitForRenderer()
+
+{
+  unique_lock<mutex> l( renderLock );
+  renderIdle.wait( l, [&]{ return !requestPending && !rendering; } );
+}
+
+
+
+// The render thread.  Each frame is rendered into 'backImage' and only
+// the changed rectangle is then copied into 'readyImage', from which
+// showFrame() takes it, so the displayed image never shows a half-drawn
+// frame.
+
+void Editor::renderLoop()
+
+{
+  while (true) {
+
+    RenderRequest request;
+
+    {
+      unique_lock<mutex> l( renderLock );
+      renderWake.wait( l, [&]{ return requestPending || stopRenderer; } );
+      if (stopRenderer)
+        return;
+      request = pendingRequest;
+      requestPending = false;
+      rendering = true;
+      renderingPreview = request.settings.preview;
+      cancelRender = false;
+    }
+
+    DirtyRect region = render( editedImage, backImage, request.transform, request.tone, request.settings );
+
+    if (cancelRender) {
+
+      // Some tiles were skipped, so 'backImage' is only partly drawn
+      // and the old footprint may not have been cleared.  Don't show
+      // it, and make the next frame redraw all of 'region'.
+
+      footprint = footprint.unite( region );
+      stats.framesCancelled++;
+
+    } else if (!region.empty())
+      publish( region, request.posted );
+
+    {
+      lock_guard<mutex> l( renderLock );
+      rendering = false;
+      if (!requestPending)
+        renderIdle.notify_all();
+    }
+  }
+}
+
+
+
+// Copy 'region' of 'backImage' into 'readyImage' for showFrame()
+
+void Editor::publish( DirtyRect &region, chrono::steady_clock::time_point posted )
+
+{
+  PixelView back( backImage );
+  PixelView ready( readyImage );
+
+  {
+    lock_guard<mutex> l( displayLock );
+
+    pool->parallelFor( region.y1 - region.y0, [&]( int i ) {
+      int y = region.y0 + i;
+      memcpy( ready.row( y ) + region.x0, back.row( y ) + region.x0, (region.x1 - region.x0) * sizeof(Pixel) );
+    } );
+
+    readyRegion = readyRegion.unite( region ); // frames not yet shown add up
+    frameReady = true;
+  }
+
+  // Latency from the input event to the frame being ready to show
+
+  double latency = chrono::duration<double,milli>( chrono::steady_clock::now() - posted ).count();
+
+  lock_guard<mutex> l( renderLock );
+
+  stats.framesRendered++;
+  stats.lastLatencyMs = latency;
+  stats.maxLatencyMs = MAX( stats.maxLatencyMs, latency );
+  stats.totalLatencyMs += latency;
+}
+
+
+
+// On the thread that uploads 'displayedImage': copy the latest
+// finished frame into it.  This copies on the calling thread rather
+// than on 'pool', which the render thread may be busy with.
+
+bool Editor::showFrame()
+
+{
+  if (displayedImage == NULL)
+    return false;
+
+  DirtyRect region;
+
+  {
+    lock_guard<mutex> l( displayLock );
+
+    if (!frameReady)
+      return false;
+
+    PixelView ready( readyImage );
+    PixelView front( displayedImage );
+
+    region = readyRegion;
+    for (int y=region.y0; y<region.y1; y++)
+      memcpy( front.row( y ) + region.x0, ready.row( y ) + region.x0, (region.x1 - region.x0) * sizeof(Pixel) );
+
+    readyRegion = DirtyRect();
+    frameReady = false;
+  }
+
+  displayedImage->updated = true; // necessary to get new image shipped to GPU
+
+  addDirtyRect( region );
+
+  return true;
+}
+
+
+
+RenderStats Editor::renderStats()
+
+{
+  lock_guard<mutex> l( renderLock );
+  return stats;
+}
+
+
+
+// Bounding rectangle, clipped to a destW x destH destination, of the
+// destination pixels that a srcW x srcH source covers under T.
+//
+// The corners of the source are transformed and a pixel of margin is
+// added for the truncation to integer positions.  Filtered sampling
+// in backward projection only reads inside the source's own footprint,
+// so no extra margin is needed for the kernel.
+
+DirtyRect Editor::transformedBounds( int srcW, int srcH, int destW, int destH, mat4 &T )
+
+{
+  Affine2D A( T );
+
+  float cornerX[4] = { 0, (float) srcW, 0, (float) srcW };
+  float cornerY[4] = { 0, 0, (float) srcH, (float) srcH };
+
+  float minX = HUGE_VALF, maxX = -HUGE_VALF;
+  float minY = HUGE_VALF, maxY = -HUGE_VALF;
+
+  for (int i=0; i<4; i++) {
+    float x = A.a * cornerX[i] + A.b * cornerY[i] + A.c;
+    float y = A.d * cornerX[i] + A.e * cornerY[i] + A.f;
+    minX = MIN( minX, x );  maxX = MAX( maxX, x );
+    minY = MIN( minY, y );  maxY = MAX( maxY, y );
+  }
+
+  // (clamp as floats so that a degenerate transform cannot overflow an int)
+
+  return DirtyRect( (int) MAX( floorf( minX ) - 1, 0.0f ),
+                    (int) MAX( floorf( minY ) - 1, 0.0f ),
+                    (int) MIN( ceilf( maxX ) + 1, (float) destW ),
+                    (int) MIN( ceilf( maxY ) + 1, (float) destH ) );
+}
+
+
+
+// Backward projection between tiled images, for images too large to
+// hold in memory.  Only the destination tiles that meet 'viewport' are
+// touched.  Of those, the ones outside the transformed source are made
+// transparent (which is free if they already are).  The rest are
+// rendered one tile per task.
+//
+// For each tile, the source rectangle that its samples can reach, plus
+// the kernel's reach, is copied out of the source's cached tiles into a
+// small buffer.  The tile is then warped from that buffer with the
+// current interpolation mode and arithmetic, and tone-mapped in place.
+// Only source tiles under the footprint are ever paged in.
+//
+// Under minification a tile's samples can reach far more of the source
+// than the cache holds, so a tile whose reach is over 'maxReachPixels'
+// is split in half, and the halves split again, until each block's
+// reach fits.  A single pixel reaches only the kernel's width, so the
+// buffer is bounded whatever the scale.
+//
+// There is no pyramid here, so heavy minification is not prefiltered.
+
+void Editor::projectTiled( TiledImage *srcImage, TiledImage *destImage, mat4 &T, ToneCurve &tone, DirtyRect viewport )
+
+{
+  const int ts = TiledImage::tileSize;
+  const size_t maxReachPixels = 4 * ts * ts;  // largest source buffer per block
+
+  mat4 Tinv = T.inverse();
+  Affine2D destToSrc( Tinv );
+
+  DirtyRect wholeImage( 0, 0, destImage->width, destImage->height );
+  DirtyRect region = viewport.intersect( wholeImage );
+  DirtyRect newFootprint = transformedBounds( srcImage->width, srcImage->height, destImage->width, destImage->height, T );
+
+  if (region.empty())
+    return;
+
+  RenderSettings settings( BACKWARD, interpolationMode, warpArithmetic, false );
+  int margin = (settings.interpolation == NEAREST) ? 1 : kernels[ settings.interpolation ]->radius + 1;
+
+  int tileX0 = region.x0 / ts;
+  int tileY0 = region.y0 / ts;
+  int tilesX = (region.x1 + ts-1) / ts - tileX0;
+  int tilesY = (region.y1 + ts-1) / ts - tileY0;
+
+  pool->parallelFor( tilesX * tilesY, [&]( int i ) {
+
+    int tx = tileX0 + i % tilesX;
+    int ty = tileY0 + i / tilesX;
+
+    DirtyRect tile( tx * ts, ty * ts, (tx+1) * ts, (ty+1) * ts );
+    tile = tile.intersect( wholeImage );
+
+    DirtyRect covered = tile.intersect( newFootprint );
+
+    if (covered.empty()) {
+      destImage->clearTile( tx, ty );
+      return;
+    }
+
+    int w = tile.x1 - tile.x0;
+    int h = tile.y1 - tile.y0;
+
+    // Source rectangle reached by the samples of 'block', in tile
+    // coordinates.  Samples are taken at whole pixel positions, so the
+    // corners are the first and last pixels.
+
+    auto reachOf = [&]( DirtyRect &block ) {
+
+      float cornerX[4] = { (float) block.x0, (float) block.x1-1, (float) block.x0, (float) block.x1-1 };
+      float cornerY[4] = { (float) block.y0, (float) block.y0, (float) block.y1-1, (float) block.y1-1 };
+
+      float minX = HUGE_VALF, maxX = -HUGE_VALF;
+      float minY = HUGE_VALF, maxY = -HUGE_VALF;
+
+      for (int c=0; c<4; c++) {
+        float x = tile.x0 + cornerX[c];
+        float y = tile.y0 + cornerY[c];
+        float sx = destToSrc.a * x + destToSrc.b * y + destToSrc.c;
+        float sy = destToSrc.d * x + destToSrc.e * y + destToSrc.f;
+        minX = MIN( minX, sx );  maxX = MAX( maxX, sx );
+        minY = MIN( minY, sy );  maxY = MAX( maxY, sy );
+      }
+
+      return DirtyRect( (int) MAX( floorf( minX ) - margin, 0.0f ),
+                        (int) MAX( floorf( minY ) - margin, 0.0f ),
+                        (int) MIN( ceilf( maxX ) + margin, (float) srcImage->width ),
+                        (int) MIN( ceilf( maxY ) + margin, (float) srcImage->height ) );
+    };
+
+    PixelView dest( destImage->acquireTile( tx, ty ), ts, ts );
+
+    vector<DirtyRect> blocks( 1, DirtyRect( 0, 0, w, h ) );
+    vector<Pixel> buffer;
+
+    while (!blocks.empty()) {
+
+      DirtyRect block = blocks.back();
+      blocks.pop_back();
+
+      DirtyRect reach = reachOf( block );
+
+      if (reach.empty()) {
+        for (int y=block.y0; y<block.y1; y++)
+          memset( dest.row( y ) + block.x0, 0, (block.x1 - block.x0) * sizeof(Pixel) );
+        continue;
+      }
+
+      int bufW = reach.x1 - reach.x0;
+      int bufH = reach.y1 - reach.y0;
+
+      if (bufW * (size_t) bufH > maxReachPixels && (block.x1 - block.x0 > 1 || block.y1 - block.y0 > 1)) {
+        if (block.x1 - block.x0 >= block.y1 - block.y0) {
+          int mid = (block.x0 + block.x1) / 2;
+          blocks.push_back( DirtyRect( block.x0, block.y0, mid, block.y1 ) );
+          blocks.push_back( DirtyRect( mid, block.y0, block.x1, block.y1 ) );
+        } else {
+          int mid = (block.y0 + block.y1) / 2;
+          blocks.push_back( DirtyRect( block.x0, block.y0, block.x1, mid ) );
+          blocks.push_back( DirtyRect( block.x0, mid, block.x1, block.y1 ) );
+        }
+        continue;
+      }
+
+      // Every sample that lands in the source lands in 'reach', so
+      // clipping to the buffer is the same as clipping to the source
+
+      buffer.resize( bufW * (size_t) bufH );
+      srcImage->read( reach.x0, reach.y0, reach.x1, reach.y1, buffer.data(), bufW );
+
+      PixelView src( buffer.data(), bufW, bufH );
+
+      // The map from tile to buffer coordinates
+
+      Affine2D A = destToSrc;
+      A.c += destToSrc.a * tile.x0 + destToSrc.b * tile.y0 - reach.x0;
+      A.f += destToSrc.d * tile.x0 + destToSrc.e * tile.y0 - reach.y0;
+
+      warpTile( src, dest, A, settings, block.x0, block.y0, block.x1, block.y1 );
+    }
+
+    for (int y=0; y<h; y++)
+      tone.apply( dest.row( y ), w );
+
+    destImage->releaseTile( tx, ty );
+  } );
+}
+
+
+
+// Forward projection of the source pixels that land in the
+// destination tile [x0,x1) x [y0,y1).
+//
+// The tile is mapped back into the source to find the bounding box of
+// source pixels that can reach it; only those are pushed forward, and
+// only the ones that land inside the tile are written.
+
+void Editor::projectForwardTile( PixelView srcImage, PixelView destImage, Affine2D &srcToDest, Affine2D &destToSrc,
+                                 int x0, int y0, int x1, int y1 )
+
+{
+  Pixel transparentPixel = { 0,0,0,0 }; // fully transparent pixel (alpha = 0, so r,g,b doesn't matter)
+
+  int srcW = srcImage.width;
+  int srcH = srcImage.height;
+  int dstW = destImage.width;
+
+  Pixel *src = srcImage.pixels;
+  Pixel *dst = destImage.pixels;
+
+  // Set the tile to transparent pixels in case there are destination
+  // locations that do not get written to with forward projection.
+
+  for (int y=y0; y<y1; y++)
+    for (int x=x0; x<x1; x++)
+      dst[ x + y * dstW ] = transparentPixel;
+
+  // Source bounding box of the tile, with a one-pixel margin for the
+  // truncation to integer destination positions
+
+  float cornerX[4] = { (float) x0, (float) x1, (float) x0, (float) x1 };
+  float cornerY[4] = { (float) y0, (float) y0, (float) y1, (float) y1 };
+
+  float minX = HUGE_VALF, maxX = -HUGE_VALF;
+  float minY = HUGE_VALF, maxY = -HUGE_VALF;
+
+  for (int i=0; i<4; i++) {
+    float sx = destToSrc.a * cornerX[i] + destToSrc.b * cornerY[i] + destToSrc.c;
+    float sy = destToSrc.d * cornerX[i] + destToSrc.e * cornerY[i] + destToSrc.f;
+    minX = MIN( minX, sx );  maxX = MAX( maxX, sx );
+    minY = MIN( minY, sy );  maxY = MAX( maxY, sy );
+  }
+
+  // (clamp as floats so that a degenerate transform cannot overflow an int)
+
+  int bx0 = (int) MAX( floorf( minX ) - 1, 0.0f );
+  int by0 = (int) MAX( floorf( minY ) - 1, 0.0f );
+  int bx1 = (int) MIN( ceilf( maxX ) + 1, (float) srcW );
+  int by1 = (int) MIN( ceilf( maxY ) + 1, (float) srcH );
+
+  // Do the forward projection, row-major through the source
+
+  for (int sy=by0; sy<by1; sy++) {
+
+    float dx0 = srcToDest.b * sy + srcToDest.c;
+    float dy0 = srcToDest.e * sy + srcToDest.f;
+
+    for (int sx=bx0; sx<bx1; sx++) {
+
+      int dx = (int) (dx0 + sx * srcToDest.a);
+      int dy = (int) (dy0 + sx * srcToDest.d);
+
+      if (dx >= x0 && dx < x1 && dy >= y0 && dy < y1)
+        dst[ dx + dy * dstW ] = src[ sx + sy * srcW ];
+    }
+  }
+}
+
+
+
+// Extract the xy part of a 4x4 transform.  Only the images of the
+// origin and of the x and y unit vectors are needed.
+
+Affine2D::Affine2D( mat4 &T )
+
+{
+  vec4 o  = T * vec4( 0, 0, 0, 1 );
+  vec4 ex = T * vec4( 1, 0, 0, 0 );
+  vec4 ey = T * vec4( 0, 1, 0, 0 );
+
+  a = ex.x;  b = ey.x;  c = o.x;
+  d = ex.y;  e = ey.y;  f = o.y;
+}
+
+
+// The map p -> A( inScale * p ) / outScale, for use between images
+// that are 'inScale' and 'outScale' times smaller than the originals
+
+Affine2D Affine2D::rescaled( float inScale, float outScale )
+
+{
+  Affine2D r;
+
+  r.a = a * inScale / outScale;  r.b = b * inScale / outScale;  r.c = c / outScale;
+  r.d = d * inScale / outScale;  r.e = e * inScale / outScale;  r.f = f / outScale;
+
+  return r;
+}
+
+
+// Output pixels per input pixel, along one axis (the square root of
+// the area ratio)
+
+float Affine2D::minification()
+
+{
+  return sqrtf( fabsf( a * e - b * d ) );
+}
+
+
+
+// Narrow [x0,x1) to those x for which s0 + x*ds lies in [0,limit).
+//
+// The bounds come from solving the two linear inequalities, then are
+// nudged by testing the end points directly, so they are exact up to
+// floating-point rounding of the expression used in the warp loop.
+
+static void clipSpan( float s0, float ds, int limit, int &x0, int &x1 )
+
+{
+  if (ds == 0) {
+    if (s0 < 0 || s0 >= limit)
+      x1 = x0; // whole row is outside
+    return;
+  }
+
+  float lo = (0 - s0) / ds;
+  float hi = (limit - s0) / ds;
+
+  if (ds < 0) {
+    float t = lo; lo = hi; hi = t;
+  }
+
+  // clamp before converting so that huge values cannot overflow an int
+
+  if (lo > x0) x0 = (int) ceil( MIN( lo, (float) x1 ) );
+  if (hi < x1) x1 = (int) ceil( MAX( hi, (float) x0 ) );
+
+  while (x0 < x1 && (s0 + x0*ds < 0 || s0 + x0*ds >= limit))
+    x0++;
+  while (x1 > x0 && (s0 + (x1-1)*ds < 0 || s0 + (x1-1)*ds >= limit))
+    x1--;
+}
+
+
+
+// Resampling kernels, as functions of the distance from the sample
+// position in source pixels
+
+static float kernelWeight( InterpolationMode mode, float d )
+
+{
+  d = fabsf( d );
+
+  switch (mode) {
+
+  case BILINEAR: // tent
+    return (d < 1) ? 1 - d : 0;
+
+  case BICUBIC: { // Keys cubic convolution with a = -0.5
+    const float a = -0.5;
+    if (d < 1)
+      return ((a+2) * d - (a+3)) * d*d + 1;
+    if (d < 2)
+      return ((a * d - 5*a) * d + 8*a) * d - 4*a;
+    return 0;
+  }
+
+  case LANCZOS: { // Lanczos-3 windowed sinc
+    if (d < 1e-6)
+      return 1;
+    if (d >= 3)
+      return 0;
+    float px = M_PI * d;
+    return 3 * sinf( px ) * sinf( px / 3 ) / (px * px);
+  }
+
+  default:
+    return (d < 0.5) ? 1 : 0;
+  }
+}
+
+
+
+ResampleKernel::ResampleKernel( InterpolationMode mode )
+
+{
+  radius = (mode == LANCZOS) ? 3 : (mode == BICUBIC) ? 2 : 1;
+  numTaps = 2 * radius;
+
+  weights = new float[ numPhases * numTaps ];
+
+  for (int p=0; p<numPhases; p++) {
+
+    float frac = (p + 0.5) / numPhases; // centre of this phase's bin
+    float *w = weights + p * numTaps;
+    float sum = 0;
+
+    for (int i=0; i<numTaps; i++) {
+      w[i] = kernelWeight( mode, (i - radius + 1) - frac );
+      sum += w[i];
+    }
+
+    for (int i=0; i<numTaps; i++) // normalize so flat areas stay flat
+      w[i] /= sum;
+  }
+}
+
+
+
+// Filter the source around (sx,sy) with the separable kernel 'k'.
+//
+// Positions are in pixel-centre coordinates, so the pixel at (i,j)
+// covers [i,i+1) x [j,j+1) and has its centre at (i+0.5,j+0.5).  Taps
+// that fall off the image are clamped to the nearest edge pixel.  The
+// four channels are accumulated side by side so that each tap is one
+// 4-wide multiply-add.  The tap count is a template parameter so that
+// the tap loops unroll completely.
+
+template <int numTaps>
+static inline Pixel sampleKernel( Pixel *src, int srcW, int srcH, ResampleKernel *k, float sx, float sy )
+
+{
+  sx -= 0.5;
+  sy -= 0.5;
+
+  float fx = floorf( sx );
+  float fy = floorf( sy );
+
+  float *wx = k->phase( sx - fx );
+  float *wy = k->phase( sy - fy );
+
+  int bx = (int) fx - numTaps/2 + 1;
+  int by = (int) fy - numTaps/2 + 1;
+
+  float acc[4] = { 0,0,0,0 };
+
+  for (int j=0; j<numTaps; j++) {
+
+    Pixel *row = src + srcW * MIN( MAX( by+j, 0 ), srcH-1 );
+
+    float rowAcc[4] = { 0,0,0,0 };
+
+    for (int i=0; i<numTaps; i++) {
+      Pixel &p = row[ MIN( MAX( bx+i, 0 ), srcW-1 ) ];
+      rowAcc[0] += wx[i] * p.r;
+      rowAcc[1] += wx[i] * p.g;
+      rowAcc[2] += wx[i] * p.b;
+      rowAcc[3] += wx[i] * p.a;
+    }
 
+    for (int c=0; c<4; c++)
+      acc[c] += wy[j] * rowAcc[c];
+  }
+
+  // Round and clamp, since bicubic and Lanczos overshoot at edges
+
+  Pixel result;
+
+  result.r = (unsigned char) MIN( MAX( acc[0] + 0.5f, 0.0f ), 255.0f );
+  result.g = (unsigned char) MIN( MAX( acc[1] + 0.5f, 0.0f ), 255.0f );
+  result.b = (unsigned char) MIN( MAX( acc[2] + 0.5f, 0.0f ), 255.0f );
+  result.a = (unsigned char) MIN( MAX( acc[3] + 0.5f, 0.0f ), 255.0f );
+
+  return result;
+}
 
-void Editor::project( Texture *srcImage, Texture *destImage, mat4 &T )
+
+
+// Backward projection with an affine transform, over the destination
+// tile [x0,x1) x [y0,y1).
+//
+// The source position is a linear function of x along each
+// destination row.  Each row is clipped up front to the span that
+// lands inside the source image, so the inner loop has no bounds test:
+// everything outside the span is transparent and everything inside is
+// a straight gather (NEAREST) or a kernel-weighted sum of the source
+// pixels around the sample position.
+
+void Editor::warpBackwardTile( PixelView srcImage, PixelView destImage, Affine2D &destToSrc, InterpolationMode mode,
+                               int x0, int y0, int x1, int y1 )
 
 {
-  // Check that dimensions match
-  
-  if (srcImage->width != destImage->width || srcImage->height != destImage->height) {
-    cerr << "in Editor::project() the source and destination images have different dimensions" << endl;
-    exit(1);
+  Affine2D &A = destToSrc;
+
+  Pixel transparentPixel = { 0,0,0,0 };
+
+  int srcW = srcImage.width;
+  int srcH = srcImage.height;
+
+  Pixel *src = srcImage.pixels;
+
+  for (int y=y0; y<y1; y++) {
+
+    Pixel *out = destImage.row( y );
+
+    float sx0 = A.b * y + A.c; // source position at x = 0
+    float sy0 = A.e * y + A.f;
+
+    int spanX0 = x0;
+    int spanX1 = x1;
+
+    clipSpan( sx0, A.a, srcW, spanX0, spanX1 );
+    clipSpan( sy0, A.d, srcH, spanX0, spanX1 );
+
+    for (int x=x0; x<spanX0; x++)
+      out[x] = transparentPixel;
+
+    if (mode == NEAREST) {
+
+      // The clamp only guards against the span ends rounding differently
+      // here than in clipSpan(); it compiles to min/max, not a branch.
+
+      for (int x=spanX0; x<spanX1; x++) {
+        int sx = (int) (sx0 + x * A.a);
+        int sy = (int) (sy0 + x * A.d);
+        sx = MIN( MAX( sx, 0 ), srcW-1 );
+        sy = MIN( MAX( sy, 0 ), srcH-1 );
+        out[x] = src[ sx + sy * srcW ];
+      }
+
+    } else {
+
+      ResampleKernel *k = kernels[ mode ];
+
+      switch (k->numTaps) {
+      case 2:
+        for (int x=spanX0; x<spanX1; x++)
+          out[x] = sampleKernel<2>( src, srcW, srcH, k, sx0 + x * A.a, sy0 + x * A.d );
+        break;
+      case 4:
+        for (int x=spanX0; x<spanX1; x++)
+          out[x] = sampleKernel<4>( src, srcW, srcH, k, sx0 + x * A.a, sy0 + x * A.d );
+        break;
+      default:
+        for (int x=spanX0; x<spanX1; x++)
+          out[x] = sampleKernel<6>( src, srcW, srcH, k, sx0 + x * A.a, sy0 + x * A.d );
+        break;
+      }
+    }
+
+    for (int x=spanX1; x<x1; x++)
+      out[x] = transparentPixel;
   }
+}
 
-  // Project
-  
-  Pixel transparentPixel = { 0,0,0,0 }; // fully transparent pixel (alpha = 0, so r,g,b doesn't matter)
-    
-  if (projectionMode == FORWARD) { // Forward projection
-    
-    // Set all of the image to transparent pixels in case there are
-    // destination locations that do not get written to with forward
-    // projection.
-
-    // UNCOMMENT THE THREE LINES BELOW *AFTER* YOU GET FORWARD
-    // PROJECTION WORKING.  THEY JUST SERVE AS AN EXAMPLE OF (A) HOW
-    // TO ITERATE OVER THE IMAGE PIXELS AND (B) HOW TO SET THE PIXEL
-    // AT A PARTICULAR LOCATION.
-    
-    for (unsigned int x=0; x<destImage->width; x++)
-    for (unsigned int y=0; y<destImage->height; y++)
-    destImage->pixel( x, y ) = transparentPixel;
-    
-    // Do the forward projection
 
-    // YOUR CODE HERE
-    int i = 0;
-      //for every pixel in the source image
-      for (unsigned int x=0; x<srcImage->width; x++)
-        for (unsigned int y=0; y<srcImage->height; y++){
-            
-            vec4 srcPixCord(x, y, 0, 1);
-            vec4 dstPixCord = T * srcPixCord; 
 
-            int dstX = (int) dstPixCord.x ;
-            int dstY = (int) dstPixCord.y;
+// Fixed-point versions of the above, for NEAREST and BILINEAR.
+//
+// Source positions are 16.16 fixed point: the transform is rounded to
+// fixed point once per tile, and everything after that is integer
+// arithmetic, so the result is the same on every platform and compiler.
+//
+// The inner loops step 32-bit positions, relative to the source pixel
+// under the tile's first pixel, so they fit twice as many lanes in a
+// vector register as the float loops.  Each row's start and span are
+// found in 64 bits first.  A tile that reaches 2^15 or more source
+// pixels from its origin, which only a strong minification or a
+// near-singular transform (e.g. a scale near 0) does, can't use 32-bit
+// positions, and fixedPointFits() sends it to the floating-point path
+// instead.
+//
+// Bilinear weights are the top 8 bits of the fraction.  Each channel
+// is blended horizontally into a value below 2^16, then vertically
+// into 32 bits, so the rounding is exact.
+
+static const int fixedShift = 16;
+static const int64_t fixedOne = (int64_t) 1 << fixedShift;
 
-            destImage->pixel(dstX, dstY) = srcImage->pixel(x, y);
+static int64_t toFixed( float v )
 
-        }
+{
+  return (int64_t) llround( (double) v * fixedOne );
+}
 
-  } else { // Backward projection
 
-    // YOUR CODE HERE
-    for (unsigned int x=0; x<destImage->width; x++)
-        for (unsigned int y=0; y<destImage->height; y++){
-            vec4 dstPixCord(x, y, 0, 1); 
-            vec4 targetSrcPixCord = T.inverse() * dstPixCord; 
+// Whether the tile [x0,x1) x [y0,y1) can be warped by 'A' in fixed
+// point: every source position of the pixels [0,x1) x [0,y1), and the
+// sums clipSpanFixed() forms from them, fit in 16.16 in an int64, and
+// positions relative to the tile's origin, one step past the end of
+// each row included, fit in 16.16 in an int32.  The bounds are taken
+// in double, which can't overflow.
+
+static bool fixedPointFits( Affine2D &A, int x0, int y0, int x1, int y1 )
 
-            int targetSrcX = (int) targetSrcPixCord.x ;
-            int targetSrcY = (int) targetSrcPixCord.y;
+{
+  const double maxPosition = (double) ((int64_t) 1 << 46); // pixels; 2^62 in 16.16
+  const double maxOffset = (1 << 15) - 2;                  // pixels; under 2^31 in 16.16
 
-            if (targetSrcX < 0 || targetSrcX > destImage->width || targetSrcY < 0 || targetSrcY > destImage->height) 
-              destImage->pixel(x, y) = transparentPixel;
-            else 
-              destImage->pixel(x, y) = srcImage->pixel(targetSrcX, targetSrcY);
+  double reachX = fabs( A.a ) * x1 + fabs( A.b ) * y1 + fabs( A.c ) + 1;
+  double reachY = fabs( A.d ) * x1 + fabs( A.e ) * y1 + fabs( A.f ) + 1;
 
-        }
+  double offsetX = fabs( A.a ) * (x1 - x0 + 1) + fabs( A.b ) * (y1 - y0) + 1;
+  double offsetY = fabs( A.d ) * (x1 - x0 + 1) + fabs( A.e ) * (y1 - y0) + 1;
+
+  return reachX < maxPosition && reachY < maxPosition && offsetX < maxOffset && offsetY < maxOffset;
+}
+
+
+// floor( a / b ) for b > 0
+
+static int64_t floorDiv( int64_t a, int64_t b )
+
+{
+  int64_t q = a / b;
+  return (q * b > a) ? q-1 : q;
+}
+
+
+// Narrow [x0,x1) to those x for which s0 + x*ds lies in [0,limit).
+// In integer arithmetic the bounds are exact, so no nudging is needed.
+
+static void clipSpanFixed( int64_t s0, int64_t ds, int64_t limit, int &x0, int &x1 )
+
+{
+  int64_t lo, hi; // the span is lo <= x < hi
+
+  if (ds == 0) {
+    if (s0 < 0 || s0 >= limit)
+      x1 = x0;
+    return;
+  }
+
+  if (ds > 0) {
+    lo = -floorDiv( s0, ds );                 // ceil( -s0 / ds )
+    hi = -floorDiv( s0 - limit, ds );         // ceil( (limit - s0) / ds )
+  } else {
+    lo = floorDiv( s0 - limit, -ds ) + 1;     // s0 + x*ds < limit
+    hi = floorDiv( s0, -ds ) + 1;             // s0 + x*ds >= 0
+  }
+
+  if (lo > x0) x0 = (int) MIN( lo, (int64_t) x1 );
+  if (hi < x1) x1 = (int) MAX( hi, (int64_t) x0 );
+}
+
+
+// Blend four channel values with 8-bit weights, rounding to nearest
+
+static inline unsigned char lerpFixed( unsigned int v00, unsigned int v10, unsigned int v01, unsigned int v11,
+                                       int fx, int fy )
+
+{
+  unsigned int top    = v00 * (256 - fx) + v10 * fx; // < 2^16
+  unsigned int bottom = v01 * (256 - fx) + v11 * fx;
+
+  return (unsigned char) ((top * (256 - fy) + bottom * fy + (1 << 15)) >> 16);
+}
+
+
+// Sample at (ox,oy) plus the 16.16 offset (rx,ry), which lies in the
+// source image
+
+static inline Pixel sampleBilinearFixed( Pixel *src, int srcW, int srcH, int ox, int oy, int32_t rx, int32_t ry )
+
+{
+  // to pixel-centre coordinates, as in sampleKernel()
+
+  rx -= fixedOne / 2;
+  ry -= fixedOne / 2;
+
+  int ix = ox + (rx >> fixedShift); // the shifts floor
+  int iy = oy + (ry >> fixedShift);
+
+  int fx = (rx & (fixedOne - 1)) >> (fixedShift - 8); // in [0,256)
+  int fy = (ry & (fixedOne - 1)) >> (fixedShift - 8);
+
+  // Only the first and last pixels of a span can sample past the edge
+
+  int x0 = MAX( ix, 0 );
+  int x1 = MIN( ix+1, srcW-1 );
+  int y0 = MAX( iy, 0 );
+  int y1 = MIN( iy+1, srcH-1 );
+
+  Pixel &p00 = src[ x0 + srcW * y0 ],  &p10 = src[ x1 + srcW * y0 ];
+  Pixel &p01 = src[ x0 + srcW * y1 ],  &p11 = src[ x1 + srcW * y1 ];
+
+  Pixel result;
+
+  result.r = lerpFixed( p00.r, p10.r, p01.r, p11.r, fx, fy );
+  result.g = lerpFixed( p00.g, p10.g, p01.g, p11.g, fx, fy );
+  result.b = lerpFixed( p00.b, p10.b, p01.b, p11.b, fx, fy );
+  result.a = lerpFixed( p00.a, p10.a, p01.a, p11.a, fx, fy );
+
+  return result;
+}
+
+
+void Editor::warpBackwardTileFixed( PixelView srcImage, PixelView destImage, Affine2D &destToSrc, InterpolationMode mode,
+                                    int x0, int y0, int x1, int y1 )
+
+{
+  if (!fixedPointFits( destToSrc, x0, y0, x1, y1 )) {
+    warpBackwardTile( srcImage, destImage, destToSrc, mode, x0, y0, x1, y1 );
+    return;
+  }
+
+  int64_t a = toFixed( destToSrc.a ),  b = toFixed( destToSrc.b ),  c = toFixed( destToSrc.c );
+  int64_t d = toFixed( destToSrc.d ),  e = toFixed( destToSrc.e ),  f = toFixed( destToSrc.f );
+
+  // The source pixel under (x0,y0), which positions are relative to.
+  // Any pixel that is drawn lies in the source, so (ox,oy) is within
+  // 2^15 pixels of it and fits in an int.
+
+  int64_t ox = floorDiv( a * x0 + b * y0 + c, fixedOne );
+  int64_t oy = floorDiv( d * x0 + e * y0 + f, fixedOne );
+
+  Pixel transparentPixel = { 0,0,0,0 };
+
+  int srcW = srcImage.width;
+  int srcH = srcImage.height;
+
+  Pixel *src = srcImage.pixels;
+
+  for (int y=y0; y<y1; y++) {
+
+    Pixel *out = destImage.row( y );
+
+    int64_t sx0 = b * y + c; // source position at x = 0
+    int64_t sy0 = e * y + f;
+
+    int spanX0 = x0;
+    int spanX1 = x1;
+
+    clipSpanFixed( sx0, a, srcW * fixedOne, spanX0, spanX1 );
+    clipSpanFixed( sy0, d, srcH * fixedOne, spanX0, spanX1 );
+
+    for (int x=x0; x<spanX0; x++)
+      out[x] = transparentPixel;
+
+    if (spanX0 < spanX1) {
+
+      int32_t rx = (int32_t) (sx0 + spanX0 * a - ox * fixedOne);
+      int32_t ry = (int32_t) (sy0 + spanX0 * d - oy * fixedOne);
+      int32_t ra = (int32_t) a;
+      int32_t rd = (int32_t) d;
+
+      if (mode == NEAREST) {
+        int64_t origin = ox + oy * srcW;
+        for (int x=spanX0; x<spanX1; x++, rx += ra, ry += rd) // the shifts floor
+          out[x] = src[ origin + (rx >> fixedShift) + (int64_t) (ry >> fixedShift) * srcW ];
+      } else {
+        for (int x=spanX0; x<spanX1; x++, rx += ra, ry += rd)
+          out[x] = sampleBilinearFixed( src, srcW, srcH, (int) ox, (int) oy, rx, ry );
+      }
+    }
+
+    for (int x=spanX1; x<x1; x++)
+      out[x] = transparentPixel;
+  }
+}
+
+
+
+// Backward projection of one tile with the kernel and arithmetic in
+// 'settings'.  Fixed point is only available for NEAREST and BILINEAR.
+
+void Editor::warpTile( PixelView srcImage, PixelView destImage, Affine2D &destToSrc, RenderSettings &settings,
+                       int x0, int y0, int x1, int y1 )
+
+{
+  if (settings.arithmetic == FIXED_POINT && (settings.interpolation == NEAREST || settings.interpolation == BILINEAR))
+    warpBackwardTileFixed( srcImage, destImage, destToSrc, settings.interpolation, x0, y0, x1, y1 );
+  else
+    warpBackwardTile( srcImage, destImage, destToSrc, settings.interpolation, x0, y0, x1, y1 );
+}
+
+
+
+// Time backward projection with each interpolation kernel and report
+// the throughput in megapixels per second.  The transform is a small
+// rotation and minification of the current view, so that every
+// destination pixel needs a real resampling.  Frames are drawn into a
+// scratch image, so the display is left alone.  The kernels that have
+// a fixed-point path are timed with it as well.
+
+void Editor::benchmarkKernels()
+
+{
+  const char *names[4] = { "nearest", "bilinear", "bicubic", "lanczos-3" };
+  const int numReps = 10;
+
+  ProjectionMode savedProjectionMode = projectionMode;
+  InterpolationMode savedInterpolationMode = interpolationMode;
+  WarpArithmetic savedWarpArithmetic = warpArithmetic;
+
+  projectionMode = BACKWARD;
+
+  waitForRenderer();
+
+  Texture scratch( *editedImage );
+
+  float cx = displayedImage->width / 2.0;
+  float cy = displayedImage->height / 2.0;
+
+  mat4 T = translate( cx, cy, 0 ) * rotate( 0.1, vec3(0,0,1) ) * scale( 0.9, 0.9, 1 ) * translate( -cx, -cy, 0 )
+           * accumulatedTransform;
+
+  double numPixels = displayedImage->width * (double) displayedImage->height;
+
+  // NEAREST and BILINEAR are timed in floating and fixed point
+
+  for (int run=0; run<6; run++) {
+
+    int m = (run < 4) ? run : run - 4;
+
+    interpolationMode = (InterpolationMode) m;
+    warpArithmetic = (run < 4) ? FLOATING_POINT : FIXED_POINT;
+
+    project( editedImage, &scratch, T, accumulatedTone ); // warm up caches and workers
+
+    auto start = chrono::steady_clock::now();
+    for (int i=0; i<numReps; i++)
+      project( editedImage, &scratch, T, accumulatedTone );
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    cout << names[m] << (run < 4 ? "" : " (fixed point)") << ": " << numPixels * numReps / elapsed.count() / 1e6 << " Mpixels/s"
+         << " (" << elapsed.count() / numReps * 1000 << " ms/frame)" << endl;
   }
 
-  destImage->updated = true; // necessary to get new image shipped to GPU
+  projectionMode = savedProjectionMode;
+  interpolationMode = savedInterpolationMode;
+  warpArithmetic = savedWarpArithmetic;
 }
 
 
@@ -86,8 +1316,19 @@ void Editor::project( Texture *srcImage, Texture *destImage, mat4 &T )
 void Editor::startMouseMotion( float x, float y )
 
 {
+  showFrame(); // any frame finished since the last event
+
   initMousePosition = vec2(x,y);
   mouseDragging = true;
+  mouseMoved = false;
+
+  // A progressive drag shows low-resolution previews until release
+
+  previewing = progressive;
+
+  recentMovementTransform = identity4();
+
+  recentTone = accumulatedTone;
 }
 
 
@@ -95,9 +1336,13 @@ void Editor::startMouseMotion( float x, float y )
 void Editor::mouseMotion( float x, float y )
 
 {
+  showFrame();
+
   vec2 mousePosition( x, y );
   vec2 imageCentre( displayedImage->height/2, displayedImage->width/2 );
 
+  mouseMoved = true;
+
   if (editMode == TRANSLATE) {
 
     // Use translate() from linalg.h to build a 4x4 translation matrix
@@ -110,9 +1355,9 @@ void Editor::mouseMotion( float x, float y )
     
     mat4 T = recentMovementTransform * accumulatedTransform;
 
-    // Apply the new transform using the project() function
+    // Apply the new transform by asking the render thread to project it
     
-    project( editedImage, displayedImage, T );
+    requestRender( T, accumulatedTone, previewing );
 
   } else if (editMode == ROTATE) {
 
@@ -136,7 +1381,7 @@ void Editor::mouseMotion( float x, float y )
     mat4 T = recentMovementTransform * accumulatedTransform;
 
 
-    project(editedImage, displayedImage, T );
+    requestRender( T, accumulatedTone, previewing );
 
 
   } else if (editMode == SCALE) {
@@ -160,47 +1405,24 @@ void Editor::mouseMotion( float x, float y )
     recentMovementTransform = translateBack * (scaleTransform * translateToOrigin) ; // combine translating and scaling
     mat4 T = recentMovementTransform * accumulatedTransform; //combine recentMovementTransform with accumulatedtransform 
 
-    project( editedImage, displayedImage, T );
+    requestRender( T, accumulatedTone, previewing );
 
     
   } else if (editMode == INTENSITY) {
 
-    // YOUR CODE HERE (calculate scale and bias)
-
-    for (unsigned int x=0; x<editedImage->width; x++)
-      for (unsigned int y=0; y<editedImage->height; y++) {
-
-	        Pixel &src  = editedImage->pixel( x, y );
-	        Pixel &dest = displayedImage->pixel( x, y );
-
-	// Convert the source pixel to HSL, modify the luminance
-	// component, the convert back and store in the destination
-	// pixel.
-	
-	// YOUR CODE HERE
-
-    vec3 temp = rgb_to_hsl(src); //RGB to HSL
-
     float brt = (mousePosition.y - initMousePosition.y)/200; //modify luminance/intensity with y movement
     float con = 1+ (mousePosition.x - initMousePosition.x)/200; //modifying luminance/intensity with x movement
 
-    //Contrast w/ birghtness adjustment 
-    temp.z = (con * temp.z) + brt; 
+    recentContrast = con;
+    recentBrightness = brt;
 
-    //clamping
-    if (temp.z >= 0.99)
-        temp.z = 0.99;
-    if (temp.z <= 0.01)
-        temp.z = 0.01;
-   
-    dest = hsl_to_rgb(temp); //Convert modified HSL back to RGB
+    // Add the change to the tone curve and redraw.  The curve is
+    // applied as each tile is projected, so 'editedImage' is never
+    // modified.
 
-	// Also copy alpha, as that is lost in the RGB -> HSL -> RGB conversion
+    recentTone = accumulatedTone.adjusted( con, brt );
 
-	dest.a = src.a;
-      }
-
-    displayedImage->updated = true; // necessary to get new image shipped to GPU
+    requestRender( accumulatedTransform, recentTone, previewing );
   }
 }
 
@@ -211,38 +1433,101 @@ void Editor::mouseMotion( float x, float y )
 // This required that any movement changed be incorporated into the
 // 'accumulatedTransform', and any intensity changes be incorporated
 // into the 'editedImage'
+//
+// Each committed change is also recorded in the edit history.  A click
+// without any motion changes nothing and is not recorded.
 
 void Editor::stopMouseMotion()
 
 {
-  if (editMode == TRANSLATE || editMode == ROTATE || editMode == SCALE) {
+  showFrame();
+
+  if (!mouseMoved) {
+
+    // nothing to do
+
+  } else if (editMode == TRANSLATE || editMode == ROTATE || editMode == SCALE) {
 
     // Incorporate the transform from the mouse drag into the 'accumulatedTransform'.
 
-    // YOUR CODE HERE
     accumulatedTransform = recentMovementTransform  *  accumulatedTransform;
 
+    history->record( EditCommand( recentMovementTransform ) );
+
   } else if (editMode == INTENSITY) {
 
-    // Incorporate the intensity changes from the mouse drag into the 'editedImage'.
+    // Incorporate the intensity changes from the mouse drag into the
+    // 'accumulatedTone'.
 
-    // YOUR CODE HERE
-    editedImage = new Texture( *displayedImage );
+    accumulatedTone = recentTone;
+
+    history->record( EditCommand( recentContrast, recentBrightness ) );
   }
-  
+
+  if (mouseMoved && history->needsCheckpoint())
+    history->checkpoint( accumulatedTransform, accumulatedTone );
+
+  if (mouseMoved && previewing) // replace the last preview with a full render
+    requestRender( accumulatedTransform, accumulatedTone, false );
+
+  previewing = false;
   mouseDragging = false;
 }
 
 
 
+// Undo or redo by restoring the nearest checkpoint and replaying the
+// commands after it.  Transforms replay as a matrix product and
+// intensity edits as a change to the tone curve.
+
+void Editor::undo()
+
+{
+  if (history->canUndo()) {
+    history->undo();
+    rebuildFromHistory();
+  }
+}
+
+
+void Editor::redo()
+
+{
+  if (history->canRedo()) {
+    history->redo();
+    rebuildFromHistory();
+  }
+}
+
+
+void Editor::rebuildFromHistory()
+
+{
+  Checkpoint &checkpoint = history->nearestCheckpoint();
+
+  accumulatedTransform = checkpoint.transform;
+  accumulatedTone = checkpoint.tone;
+
+  for (int i=checkpoint.commandIndex; i<history->numCommandsApplied(); i++) {
+
+    EditCommand &c = history->command( i );
+
+    if (c.type == TRANSFORM_EDIT)
+      accumulatedTransform = c.transform * accumulatedTransform;
+    else
+      accumulatedTone = accumulatedTone.adjusted( c.contrast, c.brightness );
+  }
+
+  requestRender( accumulatedTransform, accumulatedTone, false );
+}
+
+
+
 // Convert between RGB in [0,255] and HSL in [0,1]
 //
 // From https://gist.github.com/ciembor/1494530
 
 
-#define MIN(a,b) ((a)<(b)?(a):(b))
-#define MAX(a,b) ((a)>(b)?(a):(b))
-
 vec3 Editor::rgb_to_hsl( Pixel rgb )
 
 {
@@ -326,11 +1611,14 @@ Pixel Editor::hsl_to_rgb( vec3 hsl ) // From https://gist.github.com/ciembor/149
 void Editor::keyPress( int key )
 
 {
+  showFrame();
+
   // ignore key presses while the mouse is being dragged
   
   if (mouseDragging)
     return;
 
+
   // handle key press
   
   switch (key) {
@@ -357,11 +1645,58 @@ void Editor::keyPress( int key )
     
   case 'F':
     projectionMode = FORWARD;
-    project( editedImage, displayedImage, accumulatedTransform );
+    requestRender( accumulatedTransform, accumulatedTone, false );
     break;
   case 'B':
     projectionMode = BACKWARD;
-    project( editedImage, displayedImage, accumulatedTransform );
+    requestRender( accumulatedTransform, accumulatedTone, false );
+    break;
+
+    // Interpolation (used in backward projection)
+
+  case 'K':
+    interpolationMode = (InterpolationMode) ((interpolationMode + 1) % 4);
+    cout << "interpolation: "
+         << (interpolationMode == NEAREST ? "nearest" :
+             interpolationMode == BILINEAR ? "bilinear" :
+             interpolationMode == BICUBIC ? "bicubic" : "lanczos-3") << endl;
+    requestRender( accumulatedTransform, accumulatedTone, false );
+    break;
+  case 'X':
+    warpArithmetic = (warpArithmetic == FLOATING_POINT) ? FIXED_POINT : FLOATING_POINT;
+    cout << "warp arithmetic: " << (warpArithmetic == FIXED_POINT ? "16.16 fixed point" : "floating point") << endl;
+    requestRender( accumulatedTransform, accumulatedTone, false );
+    break;
+  case 'P':
+    benchmarkKernels();
+    break;
+
+    // Progressive (low-resolution while dragging) rendering
+
+  case 'V':
+    progressive = !progressive;
+    cout << "progressive rendering " << (progressive ? "on" : "off") << endl;
+    break;
+
+    // Render thread statistics
+
+  case 'L': {
+    RenderStats s = renderStats();
+    cout << "frames: " << s.framesRendered << " shown, " << s.framesCancelled << " cancelled; "
+         << "events: " << s.eventsPosted << " posted, " << s.eventsCoalesced << " coalesced; "
+         << "latency: " << s.lastLatencyMs << " ms last, "
+         << (s.framesRendered > 0 ? s.totalLatencyMs / s.framesRendered : 0) << " ms mean, "
+         << s.maxLatencyMs << " ms max" << endl;
+    break;
+  }
+
+    // Edit history
+
+  case 'Z':
+    undo();
+    break;
+  case 'Y':
+    redo();
     break;
   }
 }
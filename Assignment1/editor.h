@@ -6,37 +6,415 @@
 
 #include "headers.h"
 #include "texture.h"
+#include "threadpool.h"
+#include "history.h"
+#include "tone.h"
+#include "tiledimage.h"
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 
 
 typedef enum { TRANSLATE, ROTATE, SCALE, INTENSITY } EditMode;
 typedef enum { FORWARD, BACKWARD } ProjectionMode;
+typedef enum { NEAREST, BILINEAR, BICUBIC, LANCZOS } InterpolationMode;
+typedef enum { FLOATING_POINT, FIXED_POINT } WarpArithmetic;
+
+
+// 2D affine map taking pixel (x,y) to (a*x + b*y + c, d*x + e*y + f)
+
+class Affine2D {
+
+ public:
+
+  float a, b, c;
+  float d, e, f;
+
+  Affine2D() {}
+
+  Affine2D( mat4 &T ); // the xy part of a 4x4 transform
+
+  Affine2D rescaled( float inScale, float outScale );
+  float minification();
+};
+
+
+// A row-major block of pixels: the pixels of a Texture, a mip level or
+// a preview buffer.  The view does not own the pixels.
+
+class PixelView {
+
+ public:
+
+  Pixel *pixels;
+  int width, height;
+
+  PixelView() {
+    pixels = NULL;
+    width = height = 0;
+  }
+
+  PixelView( Pixel *p, int w, int h ) {
+    pixels = p;
+    width = w;
+    height = h;
+  }
+
+  PixelView( Texture *t ) { // texture pixels are stored row-major
+    pixels = &t->pixel( 0, 0 );
+    width = t->width;
+    height = t->height;
+  }
+
+  Pixel *row( int y ) {
+    return pixels + y * width;
+  }
+};
+
+
+// One reduced level of a mip pyramid
+
+class MipLevel {
+
+ public:
+
+  int width, height;
+  vector<Pixel> pixels;
+
+  MipLevel( int w, int h ) : pixels( w * h ) {
+    width = w;
+    height = h;
+  }
+};
+
+
+// A rectangle of pixels [x0,x1) x [y0,y1)
+
+class DirtyRect {
+
+ public:
+
+  int x0, y0, x1, y1;
+
+  DirtyRect() {
+    x0 = y0 = x1 = y1 = 0;
+  }
+
+  DirtyRect( int _x0, int _y0, int _x1, int _y1 ) {
+    x0 = _x0;  y0 = _y0;
+    x1 = _x1;  y1 = _y1;
+  }
+
+  bool empty() {
+    return x0 >= x1 || y0 >= y1;
+  }
+
+  // smallest rectangle containing both
+
+  DirtyRect unite( DirtyRect &r ) {
+    if (empty())
+      return r;
+    if (r.empty())
+      return *this;
+    return DirtyRect( x0 < r.x0 ? x0 : r.x0, y0 < r.y0 ? y0 : r.y0,
+                      x1 > r.x1 ? x1 : r.x1, y1 > r.y1 ? y1 : r.y1 );
+  }
+
+  DirtyRect intersect( DirtyRect &r ) {
+    return DirtyRect( x0 > r.x0 ? x0 : r.x0, y0 > r.y0 ? y0 : r.y0,
+                      x1 < r.x1 ? x1 : r.x1, y1 < r.y1 ? y1 : r.y1 );
+  }
+};
+
+
+// Precomputed weights of a separable resampling kernel.
+//
+// The fractional part of a sample position is quantized to one of
+// 'numPhases' phases.  For each phase there are 'numTaps' weights,
+// normalized to sum to 1, for the source pixels starting 'radius'-1
+// pixels before the pixel at or to the left of the sample position.
+
+class ResampleKernel {
+
+ public:
+
+  static const int numPhases = 64;
+
+  int radius;
+  int numTaps;       // 2 * radius
+  float *weights;    // numPhases x numTaps, row per phase
+
+  ResampleKernel( InterpolationMode mode );
+
+  ~ResampleKernel() {
+    delete [] weights;
+  }
+
+  // Weights for a sample position with fractional part 'frac' in [0,1)
+
+  float *phase( float frac ) {
+    int p = (int) (frac * numPhases);
+    return weights + numTaps * (p < numPhases ? p : numPhases-1);
+  }
+};
+
+
+// The modes that a frame is rendered with.  They are copied into each
+// render request, so changing a mode doesn't affect a frame in progress.
+
+class RenderSettings {
+
+ public:
+
+  ProjectionMode projection;
+  InterpolationMode interpolation;
+  WarpArithmetic arithmetic;
+  bool preview;                 // render at reduced resolution from the pyramid
+
+  RenderSettings() {}
+
+  RenderSettings( ProjectionMode p, InterpolationMode i, WarpArithmetic a, bool prev ) {
+    projection = p;
+    interpolation = i;
+    arithmetic = a;
+    preview = prev;
+  }
+};
+
+
+// A frame waiting for the render thread
+
+class RenderRequest {
+
+ public:
+
+  mat4 transform;
+  ToneCurve tone;
+  RenderSettings settings;
+  chrono::steady_clock::time_point posted; // when the input event arrived
+};
+
+
+// Counters kept by the render thread
+
+class RenderStats {
+
+ public:
+
+  long eventsPosted;            // render requests made
+  long eventsCoalesced;         // requests replaced by a newer one before being drawn
+  long framesRendered;          // frames copied to 'displayedImage'
+  long framesCancelled;         // frames abandoned for a newer preview
+
+  double lastLatencyMs;         // time from request to frame shown
+  double maxLatencyMs;
+  double totalLatencyMs;
+
+  RenderStats() {
+    eventsPosted = eventsCoalesced = framesRendered = framesCancelled = 0;
+    lastLatencyMs = maxLatencyMs = totalLatencyMs = 0;
+  }
+};
 
 
 class Editor {
 
-  Texture *editedImage;		// stores per-pixel changes
-  Texture *displayedImage;      // is transformed version of 'editedImage'
+  Texture *editedImage;		// the original image; edits are applied as it is projected
+  Texture *displayedImage;      // is transformed and tone-mapped version of 'editedImage'
+  Texture *backImage;           // frame being drawn by the render thread
+  Texture *readyImage;          // last finished frame, not yet shown by showFrame()
 
   mat4 accumulatedTransform;    // all transforms so far, in one matrix
   mat4 recentMovementTransform; // most recent transform made during a movement edit
 
+  ToneCurve accumulatedTone;    // all intensity edits so far, as one lightness curve
+  ToneCurve recentTone;         // 'accumulatedTone' with the current intensity drag added
+
   vec2 initMousePosition;       // position on initial mouse click
   bool mouseDragging;		// true while mouse is being dragged to edit
+  bool mouseMoved;              // true once the current drag has moved
+
+  float recentContrast;         // intensity change made during the current drag
+  float recentBrightness;
+
+  EditHistory *history;         // committed edits, for undo/redo
+
+  ThreadPool *pool;             // workers for tile-parallel projection
+
+  DirtyRect footprint;          // part of 'backImage' that may be non-transparent
+  mutex dirtyLock;              // guards 'dirtyRects'
+
+  vector<MipLevel> pyramid;     // levels 1, 2, ... of the mip pyramid of 'editedImage'
+  bool pyramidValid;            // true once the pyramid has been built
+  static const unsigned int maxPyramidLevels = 16;
+
+  bool previewing;              // true during a progressive drag
+  vector<Pixel> previewPixels;  // low-resolution frame shown while previewing
+
+  thread renderThread;          // draws requested frames into 'backImage'
+  mutex renderLock;             // guards the request and state below, and 'stats'
+  condition_variable renderWake;  // signalled when a request is posted
+  condition_variable renderIdle;  // signalled when the render thread runs out of work
+  RenderRequest pendingRequest; // latest request not yet taken by the render thread
+  bool requestPending;
+  bool rendering;               // a frame is being drawn
+  bool renderingPreview;        // ... and it is a preview
+  bool stopRenderer;
+  atomic<bool> cancelRender;    // set to abandon the frame being drawn
+  RenderStats stats;
+
+  mutex displayLock;            // guards 'readyImage', 'readyRegion' and 'frameReady'
+  DirtyRect readyRegion;        // part of 'readyImage' that differs from 'displayedImage'
+  bool frameReady;
+
+  static const int tileSize = 64; // projection tiles are tileSize x tileSize pixels
+
+  void projectForwardTile( PixelView srcImage, PixelView destImage, Affine2D &srcToDest, Affine2D &destToSrc,
+                           int x0, int y0, int x1, int y1 );
+  void warpBackwardTile( PixelView srcImage, PixelView destImage, Affine2D &destToSrc, InterpolationMode mode,
+                         int x0, int y0, int x1, int y1 );
+  void warpBackwardTileFixed( PixelView srcImage, PixelView destImage, Affine2D &destToSrc, InterpolationMode mode,
+                              int x0, int y0, int x1, int y1 );
+  void warpTile( PixelView srcImage, PixelView destImage, Affine2D &destToSrc, RenderSettings &settings,
+                 int x0, int y0, int x1, int y1 );
+  void renderTiles( PixelView src, PixelView dest, Affine2D &srcToDest, Affine2D &destToSrc, ToneCurve &tone,
+                    RenderSettings &settings, DirtyRect &region );
+  DirtyRect render( Texture *srcImage, Texture *destImage, mat4 &T, ToneCurve &tone, RenderSettings &settings );
+
+  void buildPyramid();
+  PixelView pyramidLevel( int l );
+  int levelForMinification( float m );
+  int previewLevelFor( Texture *destImage );
+  void renderPreview( PixelView dest, Affine2D &destToSrc, ToneCurve &tone, DirtyRect &region, int level );
+  void requestRender( mat4 &T, ToneCurve &tone, bool preview );
+  void renderLoop();
+  void publish( DirtyRect &region, chrono::steady_clock::time_point posted );
+  void rebuildFromHistory();
+  DirtyRect transformedBounds( int srcW, int srcH, int destW, int destH, mat4 &T );
+
+  ResampleKernel *kernels[4];   // weight tables, indexed by InterpolationMode (NEAREST has none)
 
  public:
 
   EditMode  editMode;
   ProjectionMode projectionMode;
+  InterpolationMode interpolationMode; // sampling used by backward projection
+  WarpArithmetic warpArithmetic;       // FIXED_POINT is used for NEAREST and BILINEAR backward projection
+
+  bool progressive;             // preview at low resolution while dragging, refine on release
+  long previewPixelBudget;      // max pixels rendered per preview frame
+
+  // Rectangles of 'displayedImage' changed since the last upload.
+  // 'updated' is still set on every change; a renderer that wants to
+  // upload only the changed parts takes these with takeDirtyRects()
+  // and sends each one with glTexSubImage2D().
+  //
+  // The rectangles don't overlap: each new one is merged with those it
+  // meets.  If there are ever more than 'maxDirtyRects' (e.g. because
+  // nothing takes them), they collapse to their bounding rectangle, so
+  // the list stays short however long the session.
+
+  vector<DirtyRect> dirtyRects;
+
+  static const unsigned int maxDirtyRects = 16;
+
+  vector<DirtyRect> takeDirtyRects() {
+    lock_guard<mutex> l( dirtyLock );
+    vector<DirtyRect> rects;
+    rects.swap( dirtyRects );
+    return rects;
+  }
+
+  void addDirtyRect( DirtyRect r ) {
+
+    lock_guard<mutex> l( dirtyLock );
+
+    for (unsigned int i=0; i<dirtyRects.size(); )
+      if (!dirtyRects[i].intersect( r ).empty()) {
+        r = r.unite( dirtyRects[i] );
+        dirtyRects.erase( dirtyRects.begin() + i );
+        i = 0; // the union may meet rectangles already passed
+      } else
+        i++;
+
+    dirtyRects.push_back( r );
+
+    if (dirtyRects.size() > maxDirtyRects) {
+      DirtyRect bounds;
+      for (unsigned int i=0; i<dirtyRects.size(); i++)
+        bounds = bounds.unite( dirtyRects[i] );
+      dirtyRects.assign( 1, bounds );
+    }
+  }
+
+  // With a NULL image the editor is headless: it has no images and no
+  // render thread, and is used only through projectPixels() and
+  // projectTiled().  The mouse and key functions need an image.
 
   Editor( Texture *image ) {
 
     displayedImage = image;
-    editedImage = new Texture( *image ); // a copy
+    editedImage = (image != NULL) ? new Texture( *image ) : NULL; // a copy
+    backImage = (image != NULL) ? new Texture( *image ) : NULL;
+    readyImage = (image != NULL) ? new Texture( *image ) : NULL;
 
     accumulatedTransform = identity4();
 
+    pool = new ThreadPool();
+
+    kernels[NEAREST]  = NULL;
+    kernels[BILINEAR] = new ResampleKernel( BILINEAR );
+    kernels[BICUBIC]  = new ResampleKernel( BICUBIC );
+    kernels[LANCZOS]  = new ResampleKernel( LANCZOS );
+
+    history = new EditHistory();
+    history->reset( accumulatedTransform, accumulatedTone );
+
+    if (image != NULL)
+      footprint = DirtyRect( 0, 0, image->width, image->height ); // the whole image is showing
+
+    frameReady = false;
+    pyramidValid = false;
+    previewing = false;
+    cancelRender = false;
+    requestPending = false;
+    rendering = false;
+    renderingPreview = false;
+    stopRenderer = false;
+    progressive = false;
+    previewPixelBudget = 1 << 20;
+
     editMode = TRANSLATE;
     projectionMode = FORWARD;
+    interpolationMode = NEAREST;
+    warpArithmetic = FLOATING_POINT;
+    mouseDragging = false;
+    mouseMoved = false;
+
+    if (image != NULL)
+      renderThread = thread( &Editor::renderLoop, this );
+  }
+
+  ~Editor() {
+    {
+      lock_guard<mutex> l( renderLock );
+      stopRenderer = true;
+      cancelRender = true;
+    }
+    renderWake.notify_one();
+    if (renderThread.joinable())
+      renderThread.join();
+    delete editedImage;
+    delete backImage;
+    delete readyImage;
+    delete history;
+    delete pool;
+    for (int i=0; i<4; i++)
+      delete kernels[i];
   }
 
   vec3 rgb_to_hsl( Pixel rgb );
@@ -47,7 +425,40 @@ class Editor {
   void mouseMotion( float x, float y );
   void stopMouseMotion();
   void keyPress( int key );
-  void project( Texture *srcImage, Texture *destImage, mat4 &T );
+  void project( Texture *srcImage, Texture *destImage, mat4 &T, ToneCurve &tone );
+
+  void project( Texture *srcImage, Texture *destImage, mat4 &T ) {
+    project( srcImage, destImage, T, accumulatedTone );
+  }
+  void benchmarkKernels();
+
+  // Edits are drawn on a separate render thread, which never touches
+  // 'displayedImage'.  Each finished frame waits in 'readyImage' until
+  // showFrame() copies it into 'displayedImage' and sets 'updated'.
+  // showFrame() must be called on the thread that uploads
+  // 'displayedImage', before each upload; the mouse and key functions
+  // call it too.  It returns false if there was no new frame.
+
+  bool showFrame();
+
+  void waitForRenderer();
+  RenderStats renderStats();
+
+  void projectPixels( PixelView src, PixelView dest, mat4 &T, ToneCurve &tone );
+
+  // Backward projection between out-of-core images, over the part of
+  // 'destImage' in 'viewport'
+
+  void projectTiled( TiledImage *srcImage, TiledImage *destImage, mat4 &T, ToneCurve &tone, DirtyRect viewport );
+
+  void undo();
+  void redo();
+
+  // Cap on the memory used by edit history snapshots
+
+  void setHistoryBudget( size_t bytes ) {
+    history->memoryBudget = bytes;
+  }
 };
 
 #endif
@@ -0,0 +1,170 @@
+// history.h
+
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "headers.h"
+#include "tone.h"
+
+#include <vector>
+
+
+typedef enum { TRANSFORM_EDIT, INTENSITY_EDIT } EditType;
+
+
+// One committed edit: either a transform that was multiplied onto the
+// accumulated transform, or a contrast/brightness change that was
+// appended to the accumulated tone curve.
+
+class EditCommand {
+
+ public:
+
+  EditType type;
+  mat4 transform;     // for TRANSFORM_EDIT
+  float contrast;     // for INTENSITY_EDIT: l' = contrast * l + brightness
+  float brightness;
+
+  EditCommand() {}
+
+  EditCommand( mat4 &T ) {
+    type = TRANSFORM_EDIT;
+    transform = T;
+  }
+
+  EditCommand( float con, float brt ) {
+    type = INTENSITY_EDIT;
+    contrast = con;
+    brightness = brt;
+  }
+};
+
+
+// Editor state after the first 'commandIndex' commands
+
+class Checkpoint {
+
+ public:
+
+  int commandIndex;
+  mat4 transform;     // accumulated transform
+  ToneCurve tone;     // accumulated tone curve
+
+  Checkpoint() {}
+
+  Checkpoint( int index, mat4 &T, ToneCurve &curve ) {
+    commandIndex = index;
+    transform = T;
+    tone = curve;
+  }
+};
+
+
+// Non-destructive edit history.
+//
+// Every committed edit is recorded as a small EditCommand.  The edited
+// image itself never changes, so the editor state is just the
+// accumulated transform and tone curve.  It is kept at checkpoints;
+// any other state is rebuilt by restoring the nearest earlier
+// checkpoint and replaying commands.  Recording a new command discards
+// anything that could have been redone.
+//
+// Memory is capped at 'memoryBudget' bytes by dropping the oldest
+// checkpoints, together with the commands before the oldest one kept,
+// which can then no longer be undone.  The newest checkpoint is always
+// kept.
+
+class EditHistory {
+
+  std::vector<EditCommand> commands;
+  std::vector<Checkpoint> checkpoints; // by increasing commandIndex; checkpoints[0] is the oldest state reachable
+  int numApplied;                      // commands[0..numApplied) are in effect
+
+ public:
+
+  size_t memoryBudget;                 // max bytes of commands and checkpoints
+  int checkpointInterval;              // edits between checkpoints
+
+  EditHistory( size_t budget = (size_t) 16 << 20, int interval = 16 ) {
+    numApplied = 0;
+    memoryBudget = budget;
+    checkpointInterval = interval;
+  }
+
+  // Start a new history from 'T' and 'tone'
+
+  void reset( mat4 &T, ToneCurve &tone ) {
+    commands.clear();
+    checkpoints.clear();
+    numApplied = 0;
+    checkpoints.push_back( Checkpoint( 0, T, tone ) );
+  }
+
+  void record( EditCommand c ) {
+
+    commands.resize( numApplied ); // drop the redo tail
+    while (checkpoints.size() > 1 && checkpoints.back().commandIndex > numApplied)
+      checkpoints.pop_back();
+
+    commands.push_back( c );
+    numApplied++;
+  }
+
+  // True once 'checkpointInterval' edits have been made since the last
+  // checkpoint.  Checkpoints bound the replay length and are where old
+  // history is trimmed to fit the budget.
+
+  bool needsCheckpoint() {
+    return numApplied - nearestCheckpoint().commandIndex >= checkpointInterval;
+  }
+
+  void checkpoint( mat4 &T, ToneCurve &tone ) {
+    checkpoints.push_back( Checkpoint( numApplied, T, tone ) );
+    enforceBudget();
+  }
+
+  bool canUndo() { return numApplied > checkpoints[0].commandIndex; }
+  bool canRedo() { return numApplied < (int) commands.size(); }
+
+  void undo() { if (canUndo()) numApplied--; }
+  void redo() { if (canRedo()) numApplied++; }
+
+  int numCommandsApplied() { return numApplied; }
+
+  EditCommand &command( int i ) { return commands[i]; }
+
+  // Latest checkpoint at or before the current state
+
+  Checkpoint &nearestCheckpoint() {
+    int i = checkpoints.size() - 1;
+    while (i > 0 && checkpoints[i].commandIndex > numApplied)
+      i--;
+    return checkpoints[i];
+  }
+
+  size_t memoryUsed() {
+    return commands.size() * sizeof(EditCommand) + checkpoints.size() * sizeof(Checkpoint);
+  }
+
+ private:
+
+  void enforceBudget() {
+
+    while (checkpoints.size() > 1 && memoryUsed() > memoryBudget) {
+
+      checkpoints.erase( checkpoints.begin() );
+
+      // Commands before the oldest checkpoint can no longer be
+      // replayed, so drop them and renumber
+
+      int dropped = checkpoints[0].commandIndex;
+      commands.erase( commands.begin(), commands.begin() + dropped );
+      for (unsigned int c=0; c<checkpoints.size(); c++)
+        checkpoints[c].commandIndex -= dropped;
+      numApplied -= dropped;
+    }
+  }
+};
+
+#endif
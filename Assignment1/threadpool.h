@@ -0,0 +1,136 @@
+// threadpool.h
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+
+// A persistent pool of worker threads.
+//
+// parallelFor( n, f ) calls f(0) ... f(n-1) spread over the workers
+// and the calling thread, and returns once all calls have finished.
+// Tasks are handed out one at a time from a shared counter, so uneven
+// tasks (e.g. tiles that are mostly transparent) balance themselves.
+//
+// parallelFor() may be called from several threads; the calls take
+// turns.  It must not be called from inside a task.
+
+class ThreadPool {
+
+  std::vector<std::thread> workers;
+
+  std::mutex lock;
+  std::mutex submitLock;           // held by the thread whose job is running
+  std::condition_variable wake;    // signalled when a new job is posted
+  std::condition_variable done;    // signalled when a worker finishes a job
+
+  const std::function<void(int)> *job;
+  int numTasks;
+  std::atomic<int> nextTask;
+  int busyWorkers;
+  unsigned int generation;         // incremented for each posted job
+  bool quit;
+
+  void runTasks() {
+    int i;
+    while ((i = nextTask++) < numTasks)
+      (*job)( i );
+  }
+
+  void workerLoop() {
+
+    unsigned int seen = 0;
+
+    while (true) {
+
+      {
+        std::unique_lock<std::mutex> l( lock );
+        wake.wait( l, [&]{ return quit || generation != seen; } );
+        if (quit)
+          return;
+        seen = generation;
+      }
+
+      runTasks();
+
+      {
+        std::lock_guard<std::mutex> l( lock );
+        busyWorkers--;
+      }
+      done.notify_one();
+    }
+  }
+
+ public:
+
+  ThreadPool( int numThreads = 0 ) {
+
+    if (numThreads <= 0)
+      numThreads = std::thread::hardware_concurrency();
+
+    job = NULL;
+    numTasks = 0;
+    nextTask = 0;
+    busyWorkers = 0;
+    generation = 0;
+    quit = false;
+
+    // The calling thread also runs tasks, so start one fewer worker
+
+    for (int i=1; i<numThreads; i++)
+      workers.push_back( std::thread( &ThreadPool::workerLoop, this ) );
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> l( lock );
+      quit = true;
+    }
+    wake.notify_all();
+    for (unsigned int i=0; i<workers.size(); i++)
+      workers[i].join();
+  }
+
+  int size() {
+    return workers.size() + 1;
+  }
+
+  void parallelFor( int n, const std::function<void(int)> &f ) {
+
+    if (n <= 0)
+      return;
+
+    if (n == 1 || workers.empty()) {
+      for (int i=0; i<n; i++)
+        f( i );
+      return;
+    }
+
+    std::lock_guard<std::mutex> submit( submitLock );
+
+    {
+      std::lock_guard<std::mutex> l( lock );
+      job = &f;
+      numTasks = n;
+      nextTask = 0;
+      busyWorkers = workers.size();
+      generation++;
+    }
+    wake.notify_all();
+
+    runTasks();
+
+    std::unique_lock<std::mutex> l( lock );
+    done.wait( l, [&]{ return busyWorkers == 0; } );
+    job = NULL;
+  }
+};
+
+#endif
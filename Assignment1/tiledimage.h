@@ -0,0 +1,249 @@
+// tiledimage.h
+
+
+#ifndef TILEDIMAGE_H
+#define TILEDIMAGE_H
+
+#include "headers.h"
+#include "texture.h"
+
+#include <vector>
+#include <list>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+// An RGBA image stored on disk in tileSize x tileSize tiles and paged
+// in through a bounded cache, for images too large to hold in memory.
+//
+// The file is the tiles in row-major order, each tile's pixels also
+// row-major.  Tiles at the right and bottom edges are stored full size.
+// A new file is created sparse, so unwritten tiles read as transparent
+// (all zero) pixels without taking disk space.
+//
+// A tile is used between acquireTile() and releaseTile(); while
+// acquired ("pinned") it stays mapped.  Released tiles stay mapped
+// until they are the least recently used and the cache is full.  They
+// are then unmapped, and the kernel writes any changes back to the
+// file.  Resident memory is therefore bounded by the cache size (plus
+// tiles pinned at that moment), not by the image size.
+//
+// Tiles known to be all zero are tracked as blank, so reading or
+// clearing them never touches the file.
+//
+// All functions may be called from several threads at once; two
+// threads must not write the same tile at the same time.
+
+class TiledImage {
+
+  class Tile {
+   public:
+    Pixel *pixels;                     // NULL if not mapped
+    int pins;                          // number of outstanding acquireTile() calls
+    bool blank;                        // known to be all zero
+    std::list<int>::iterator lruPos;   // position in 'lru', if mapped and not pinned
+    Tile() { pixels = NULL; pins = 0; blank = false; }
+  };
+
+  int fd;
+  size_t tileBytes;                    // file space per tile, a multiple of the page size
+  size_t maxResidentTiles;
+
+  std::vector<Tile> tiles;
+  std::list<int> lru;                  // mapped, unpinned tiles, most recently used first
+  size_t numResident;
+  std::mutex lock;
+
+  TiledImage( const TiledImage & );    // not copyable
+  TiledImage &operator=( const TiledImage & );
+
+  void unmap( int t ) {
+    munmap( tiles[t].pixels, tileBytes );
+    tiles[t].pixels = NULL;
+    numResident--;
+  }
+
+  void evict() {
+    while (numResident > maxResidentTiles && !lru.empty()) {
+      int t = lru.back();
+      lru.pop_back();
+      unmap( t );
+    }
+  }
+
+ public:
+
+  static const int tileSize = 64;
+
+  int width, height;
+  int tilesX, tilesY;
+
+  // Open the tiled image file 'path', or create a new transparent one
+  // if 'create'.  At most 'cacheBytes' of tiles are kept mapped.
+
+  TiledImage( const char *path, int w, int h, size_t cacheBytes, bool create ) {
+
+    width = w;
+    height = h;
+    tilesX = (w + tileSize-1) / tileSize;
+    tilesY = (h + tileSize-1) / tileSize;
+
+    size_t pageSize = sysconf( _SC_PAGESIZE );
+    tileBytes = tileSize * tileSize * sizeof(Pixel);
+    tileBytes = (tileBytes + pageSize-1) / pageSize * pageSize; // mmap offsets must be page aligned
+
+    maxResidentTiles = cacheBytes / tileBytes;
+    if (maxResidentTiles < 1)
+      maxResidentTiles = 1;
+
+    numResident = 0;
+    tiles.resize( tilesX * tilesY );
+
+    fd = open( path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644 );
+    if (fd < 0) {
+      cerr << "TiledImage: can't open " << path << endl;
+      exit(1);
+    }
+
+    off_t fileBytes = (off_t) tileBytes * tiles.size();
+
+    if (create) {
+      if (ftruncate( fd, fileBytes ) != 0) {
+        cerr << "TiledImage: can't size " << path << endl;
+        exit(1);
+      }
+      for (unsigned int t=0; t<tiles.size(); t++)
+        tiles[t].blank = true;
+    } else if (lseek( fd, 0, SEEK_END ) < fileBytes) {
+      cerr << "TiledImage: " << path << " is too small for a " << w << " x " << h << " image" << endl;
+      exit(1);
+    }
+  }
+
+  ~TiledImage() {
+    for (unsigned int t=0; t<tiles.size(); t++)
+      if (tiles[t].pixels != NULL)
+        unmap( t );
+    close( fd );
+  }
+
+  // Pixels of tile (tx,ty): tileSize x tileSize, row-major.  The tile
+  // stays mapped until the matching releaseTile().
+
+  Pixel *acquireTile( int tx, int ty ) {
+
+    std::lock_guard<std::mutex> l( lock );
+
+    int t = tx + ty * tilesX;
+    Tile &tile = tiles[t];
+
+    if (tile.pixels == NULL) {
+
+      void *p = mmap( NULL, tileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) tileBytes * t );
+      if (p == MAP_FAILED) {
+        cerr << "TiledImage: can't map tile (" << tx << "," << ty << ")" << endl;
+        exit(1);
+      }
+
+      tile.pixels = (Pixel *) p;
+      numResident++;
+      evict();
+
+    } else if (tile.pins == 0)
+      lru.erase( tile.lruPos );
+
+    tile.pins++;
+    tile.blank = false; // the caller may write it
+
+    return tile.pixels;
+  }
+
+  void releaseTile( int tx, int ty ) {
+
+    std::lock_guard<std::mutex> l( lock );
+
+    int t = tx + ty * tilesX;
+    Tile &tile = tiles[t];
+
+    if (--tile.pins == 0) {
+      lru.push_front( t );
+      tile.lruPos = lru.begin();
+      evict();
+    }
+  }
+
+  bool isBlank( int tx, int ty ) {
+    std::lock_guard<std::mutex> l( lock );
+    return tiles[ tx + ty * tilesX ].blank;
+  }
+
+  // Make tile (tx,ty) transparent
+
+  void clearTile( int tx, int ty ) {
+
+    if (isBlank( tx, ty ))
+      return;
+
+    memset( acquireTile( tx, ty ), 0, tileSize * tileSize * sizeof(Pixel) );
+    releaseTile( tx, ty );
+
+    std::lock_guard<std::mutex> l( lock );
+    tiles[ tx + ty * tilesX ].blank = true;
+  }
+
+  // Copy the pixels in [x0,x1) x [y0,y1) to or from 'buffer', which has
+  // 'stride' pixels per row.  The rectangle must lie inside the image.
+
+  void read( int x0, int y0, int x1, int y1, Pixel *buffer, int stride ) {
+    copyRect( x0, y0, x1, y1, buffer, stride, false );
+  }
+
+  void write( int x0, int y0, int x1, int y1, Pixel *buffer, int stride ) {
+    copyRect( x0, y0, x1, y1, buffer, stride, true );
+  }
+
+  size_t residentBytes() {
+    std::lock_guard<std::mutex> l( lock );
+    return numResident * tileBytes;
+  }
+
+ private:
+
+  void copyRect( int x0, int y0, int x1, int y1, Pixel *buffer, int stride, bool toImage ) {
+
+    for (int ty=y0/tileSize; ty*tileSize<y1; ty++)
+      for (int tx=x0/tileSize; tx*tileSize<x1; tx++) {
+
+        int cx0 = (tx*tileSize > x0) ? tx*tileSize : x0;
+        int cy0 = (ty*tileSize > y0) ? ty*tileSize : y0;
+        int cx1 = ((tx+1)*tileSize < x1) ? (tx+1)*tileSize : x1;
+        int cy1 = ((ty+1)*tileSize < y1) ? (ty+1)*tileSize : y1;
+
+        size_t rowBytes = (cx1 - cx0) * sizeof(Pixel);
+
+        if (!toImage && isBlank( tx, ty )) {
+          for (int y=cy0; y<cy1; y++)
+            memset( buffer + (y - y0) * stride + (cx0 - x0), 0, rowBytes );
+          continue;
+        }
+
+        Pixel *tile = acquireTile( tx, ty );
+
+        for (int y=cy0; y<cy1; y++) {
+          Pixel *inTile = tile + (y - ty*tileSize) * tileSize + (cx0 - tx*tileSize);
+          Pixel *inBuffer = buffer + (y - y0) * stride + (cx0 - x0);
+          if (toImage)
+            memcpy( inTile, inBuffer, rowBytes );
+          else
+            memcpy( inBuffer, inTile, rowBytes );
+        }
+
+        releaseTile( tx, ty );
+      }
+  }
+};
+
+#endif
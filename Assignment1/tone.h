@@ -0,0 +1,109 @@
+// tone.h
+
+
+#ifndef TONE_H
+#define TONE_H
+
+#include "headers.h"
+#include "texture.h"
+
+
+// A tone curve: a map from HSL lightness to new lightness, with hue
+// and saturation unchanged.
+//
+// For an 8-bit pixel the HSL lightness is (max + min) / 510, where max
+// and min are taken over r, g and b, so the curve is tabulated at all
+// 511 possible values of max + min.
+//
+// Keeping hue and saturation fixed, HSL -> RGB gives each channel as
+//
+//   c = l - s * min( l, 1-l ) * K(h)
+//
+// so changing the lightness from l to l' maps each channel to
+//
+//   c' = l' + (c - l) * min( l', 1-l' ) / min( l, 1-l )
+//
+// which needs no conversion to or from HSL at all.  That ratio is
+// tabulated alongside the curve.
+
+class ToneCurve {
+
+ public:
+
+  static const int size = 511;
+
+  float lightness[size];   // new lightness, in [0,1], for max + min = i
+  float ratio[size];       // min( l', 1-l' ) / min( l, 1-l )
+  bool identity;           // true if the curve changes nothing
+
+  ToneCurve() {
+    for (int i=0; i<size; i++)
+      lightness[i] = i / (float) (size-1);
+    update();
+    identity = true;
+  }
+
+  // This curve followed by the contrast/brightness change
+  // l -> con * l + brt, clamped to [0.01,0.99] as in an intensity drag
+
+  ToneCurve adjusted( float con, float brt ) {
+
+    ToneCurve result;
+
+    for (int i=0; i<size; i++) {
+      float l = con * lightness[i] + brt;
+      result.lightness[i] = (l > 0.99f) ? 0.99f : (l < 0.01f) ? 0.01f : l;
+    }
+
+    result.update();
+    result.identity = false;
+
+    return result;
+  }
+
+  // Apply the curve to 'n' pixels in place.  Alpha is unchanged.
+
+  void apply( Pixel *p, int n ) {
+
+    if (identity)
+      return;
+
+    for (int i=0; i<n; i++) {
+
+      int r = p[i].r;
+      int g = p[i].g;
+      int b = p[i].b;
+
+      int maxC = (r > g) ? r : g;  maxC = (maxC > b) ? maxC : b;
+      int minC = (r < g) ? r : g;  minC = (minC < b) ? minC : b;
+
+      int sum = maxC + minC;
+
+      float l = 255 * lightness[sum] + 0.5f; // (+0.5 to round)
+      float k = ratio[sum];
+      float half = 0.5f * sum;               // old lightness, in [0,255]
+
+      p[i].r = clamp( l + (r - half) * k );
+      p[i].g = clamp( l + (g - half) * k );
+      p[i].b = clamp( l + (b - half) * k );
+    }
+  }
+
+ private:
+
+  void update() {
+    for (int i=0; i<size; i++) {
+      float l  = i / (float) (size-1);
+      float m  = (l < 1-l) ? l : 1-l;
+      float l2 = lightness[i];
+      float m2 = (l2 < 1-l2) ? l2 : 1-l2;
+      ratio[i] = (m > 0) ? m2 / m : 0; // m == 0 only for black and white, which have c == l
+    }
+  }
+
+  static unsigned char clamp( float v ) {
+    return (unsigned char) ((v < 0) ? 0 : (v > 255) ? 255 : v);
+  }
+};
+
+#endif
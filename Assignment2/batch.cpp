@@ -0,0 +1,758 @@
+// batch.cpp
+//
+// Headless batch grid removal: remove the grid from every ECG scan in
+// a directory, write the cleaned scans to another directory, and
+// record the grid found in each.
+//
+//   batch <input dir> <output dir> [options]
+//
+//   -w <n>    de-gridding workers (default: one per core)
+//   -t <n>    threads per worker for its FFTs and scans (default 1)
+//   -l <n>    loader threads (default 2)
+//   -e <n>    encoder threads (default 2)
+//   -s        single precision (ComputeF) instead of double
+//   -c        complex FFTs instead of real-data FFTs
+//   -j        write the grid results as JSON rather than CSV
+//   -T <n>    de-grid scans larger than n x n in n x n tiles (see
+//             tiledcompute.h), to bound memory on very large scans
+//   -C        clean colour scans in colour
+//   -N        remove the grid with notch filters in the FT rather than
+//             by filling the grid lines (see Compute::gridRemoval)
+//   -p <file> write the time spent in each stage and the counters of
+//             all scans to <file>, as JSON (see trace.h)
+//   -P <file> write every stage of every scan to <file> as a Chrome
+//             trace, for chrome://tracing or Perfetto
+//
+// Scans are binary PGM (P5), PPM (P6) or PAM (P7) files with 8-bit
+// samples.  As in the viewer, only the first (red) channel is used and
+// each cleaned scan is written as a PGM with the input's name and a
+// .pgm extension.  With -C, the grid in a colour scan is instead found
+// from its luminance and removed from all three channels, and the scan
+// is written as a PPM (.ppm); tiled scans are still cleaned in grey.
+//
+// The grid found in each scan goes to 'grid.csv' (or 'grid.json') in
+// the output directory, in file name order: the angle of the normal
+// to each of the two grid line directions in degrees and the spacing
+// of the lines in pixels.  Scans in which no grid was found are listed
+// with status "nogrid" and no lines, and are written out unchanged.
+//
+// Loading, de-gridding and encoding run as a pipeline joined by
+// bounded queues, so a steady stream of images flows through with a
+// bounded number in memory.  Each de-gridding worker takes a Compute
+// workspace from a pool keyed by resolution, loads the scan into it,
+// runs the FFT, analysis and cleanup stages, and returns it to the
+// pool.  A run of same-resolution scans therefore allocates only one
+// workspace per worker, and all workspaces share the FFT plans (and
+// saved wisdom) of the plan cache.
+//
+// This has its own main(), so it is built as a separate program from
+// the interactive viewer.  It needs single precision (for -s) and
+// FFTW's threads (for multi-threaded FFTs with -t), which the viewer's
+// build leaves out, e.g.
+//
+//   g++ -O2 -pthread -DCOMPUTE_SINGLE_PRECISION -DFFTW_THREADS batch.cpp compute.cpp
+//       -lfftw3_threads -lfftw3f_threads -lfftw3 -lfftw3f -o batch
+
+
+#include "compute.h"
+#include "tiledcompute.h"
+
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <list>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+
+#include <dirent.h>
+
+
+// A scan and, once de-gridded, its cleaned version and the grid found
+
+class Scan {
+
+ public:
+
+  int index;                   // position in the file name order
+  string inPath, outPath;
+  int width, height;
+  vector<unsigned char> values;   // first channel, row-major
+  vector<unsigned char> rgb;      // all three channels, if cleaned in colour
+
+  vector<unsigned char> cleaned;  // grey or RGB, row-major
+};
+
+
+class ScanResult {
+
+ public:
+
+  string name;
+  int width, height;
+  bool found;                  // grid lines were found
+  float angle[2];              // normal to the lines, in degrees
+  float wavelength[2];         // line spacing, in pixels
+
+  ScanResult() {
+    width = height = 0;
+    found = false;
+  }
+};
+
+
+// A queue between pipeline stages.  put() blocks while the queue is
+// full, so a fast stage cannot run arbitrarily far ahead and fill
+// memory.  get() returns false once the queue is closed and empty.
+
+template <class T>
+class BoundedQueue {
+
+  deque<T> items;
+  unsigned int capacity;
+  bool closed;
+
+  mutex lock;
+  condition_variable notFull, notEmpty;
+
+ public:
+
+  BoundedQueue( unsigned int cap ) {
+    capacity = cap;
+    closed = false;
+  }
+
+  void put( T item ) {
+    unique_lock<mutex> l( lock );
+    notFull.wait( l, [&]{ return items.size() < capacity; } );
+    items.push_back( item );
+    notEmpty.notify_one();
+  }
+
+  bool get( T &item ) {
+    unique_lock<mutex> l( lock );
+    notEmpty.wait( l, [&]{ return !items.empty() || closed; } );
+    if (items.empty())
+      return false;
+    item = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    lock_guard<mutex> l( lock );
+    closed = true;
+    notEmpty.notify_all();
+  }
+};
+
+
+
+// Compute workspaces, reused for scans of the same resolution.
+// acquire() returns an idle workspace of the right size, or makes a
+// new one if there is none; release() makes it idle again.
+//
+// Idle workspaces are kept for only the 'maxIdleSizes' resolutions
+// released most recently; those of older resolutions are freed.  A
+// corpus of mixed sizes therefore holds at most that many sizes' idle
+// workspaces (up to one per worker each), not one set for every size
+// ever seen.
+
+template <class C>
+class WorkspacePool {
+
+  typedef pair<int,int> Size;
+
+  map< Size, vector<C *> > idle;   // only sizes with idle workspaces
+  list<Size> recent;               // sizes in 'idle', most recently released first
+  mutex lock;
+
+  bool realFFT;
+  int threads;
+  GridRemoval removal;
+  Trace *trace;
+
+ public:
+
+  atomic<int> numCreated;
+
+  static const unsigned int maxIdleSizes = 2;
+
+  WorkspacePool( bool useRealFFT, int threadsPerWorkspace, GridRemoval gridRemoval, Trace *t ) {
+    realFFT = useRealFFT;
+    threads = threadsPerWorkspace;
+    removal = gridRemoval;
+    trace = t;
+    numCreated = 0;
+  }
+
+  ~WorkspacePool() {
+    for (typename map< Size, vector<C *> >::iterator i=idle.begin(); i!=idle.end(); i++)
+      for (unsigned int j=0; j<i->second.size(); j++)
+        delete i->second[j];
+  }
+
+  C *acquire( int width, int height ) {
+
+    {
+      lock_guard<mutex> l( lock );
+      Size size( width, height );
+      typename map< Size, vector<C *> >::iterator i = idle.find( size );
+      if (i != idle.end()) {
+        C *c = i->second.back();
+        i->second.pop_back();
+        if (i->second.empty()) {
+          idle.erase( i );
+          recent.remove( size );
+        }
+        return c;
+      }
+    }
+
+    // Made outside the lock, as allocating a large workspace is slow
+
+    numCreated++;
+
+    C *c = new C( width, height, realFFT, threads, removal );
+    c->printLines = false;
+    c->trace = trace;
+    return c;
+  }
+
+  void release( C *c ) {
+
+    vector<C *> evicted;
+
+    {
+      lock_guard<mutex> l( lock );
+      Size size( c->dimX, c->dimY );
+
+      idle[ size ].push_back( c );
+      recent.remove( size );
+      recent.push_front( size );
+
+      while (recent.size() > maxIdleSizes) {
+        vector<C *> &old = idle[ recent.back() ];
+        evicted.insert( evicted.end(), old.begin(), old.end() );
+        idle.erase( recent.back() );
+        recent.pop_back();
+      }
+    }
+
+    // Freed outside the lock, as freeing a large workspace is slow
+
+    for (unsigned int i=0; i<evicted.size(); i++)
+      delete evicted[i];
+  }
+};
+
+
+
+// PGM / PPM / PAM input and output
+
+
+static string nextToken( istream &in )
+
+{
+  string token;
+
+  while (in >> token) {
+    if (token[0] != '#')
+      return token;
+    getline( in, token ); // skip the rest of a comment
+  }
+
+  return "";
+}
+
+
+static bool readScan( Scan &scan, bool colour )
+
+{
+  ifstream in( scan.inPath.c_str(), ios::binary );
+
+  if (!in)
+    return false;
+
+  string magic = nextToken( in );
+  int maxVal = 0;
+  int depth = 0;
+
+  if (magic == "P5" || magic == "P6") {
+
+    scan.width  = atoi( nextToken( in ).c_str() );
+    scan.height = atoi( nextToken( in ).c_str() );
+    maxVal      = atoi( nextToken( in ).c_str() );
+    depth = (magic == "P5") ? 1 : 3;
+
+  } else if (magic == "P7") {
+
+    string key;
+    while ((key = nextToken( in )) != "ENDHDR" && key != "") {
+      if (key == "WIDTH")       scan.width  = atoi( nextToken( in ).c_str() );
+      else if (key == "HEIGHT") scan.height = atoi( nextToken( in ).c_str() );
+      else if (key == "DEPTH")  depth       = atoi( nextToken( in ).c_str() );
+      else if (key == "MAXVAL") maxVal      = atoi( nextToken( in ).c_str() );
+      else                      nextToken( in ); // TUPLTYPE
+    }
+
+  } else
+    return false;
+
+  if (maxVal != 255 || depth < 1 || depth > 4 || scan.width <= 0 || scan.height <= 0)
+    return false;
+
+  in.get(); // the single whitespace character before the raster
+
+  scan.values.resize( scan.width * (size_t) scan.height );
+
+  if (colour && depth >= 3)
+    scan.rgb.resize( 3 * scan.width * (size_t) scan.height );
+
+  vector<unsigned char> row( scan.width * depth );
+
+  for (int y=0; y<scan.height; y++) {
+
+    if (!in.read( (char *) row.data(), row.size() ))
+      return false;
+
+    unsigned char *out = &scan.values[ y * (size_t) scan.width ];
+
+    for (int x=0; x<scan.width; x++)
+      out[x] = row[ x * depth ];
+
+    if (!scan.rgb.empty()) {
+      unsigned char *outRGB = &scan.rgb[ 3 * y * (size_t) scan.width ];
+      for (int x=0; x<scan.width; x++)
+        for (int c=0; c<3; c++)
+          outRGB[3*x+c] = row[ x * depth + c ];
+    }
+  }
+
+  return true;
+}
+
+
+static bool writeScan( Scan &scan )
+
+{
+  bool colour = !scan.rgb.empty();
+
+  scan.outPath += colour ? ".ppm" : ".pgm";
+
+  ofstream out( scan.outPath.c_str(), ios::binary );
+
+  if (!out)
+    return false;
+
+  out << (colour ? "P6\n" : "P5\n") << scan.width << " " << scan.height << "\n255\n";
+  out.write( (char *) scan.cleaned.data(), scan.cleaned.size() );
+
+  return (bool) out;
+}
+
+
+// 's' as a JSON string, with its quotes
+
+static string jsonString( const string &s )
+
+{
+  ostringstream q;
+
+  q << '"';
+
+  for (unsigned int i=0; i<s.size(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      q << '\\' << c;
+    else if (c < 0x20)
+      q << "\\u" << hex << setw( 4 ) << setfill( '0' ) << (int) c << dec << setfill( ' ' );
+    else
+      q << c;
+  }
+
+  q << '"';
+
+  return q.str();
+}
+
+
+// 's' as a CSV field: quoted, with its quotes doubled, if it holds a
+// comma, quote or line break
+
+static string csvField( const string &s )
+
+{
+  if (s.find_first_of( ",\"\r\n" ) == string::npos)
+    return s;
+
+  string q = "\"";
+
+  for (unsigned int i=0; i<s.size(); i++) {
+    if (s[i] == '"')
+      q += '"';
+    q += s[i];
+  }
+
+  return q + "\"";
+}
+
+
+static void writeResults( const string &path, vector<ScanResult> &results, bool json )
+
+{
+  ofstream out( path.c_str() );
+
+  if (!out) {
+    cerr << "can't write " << path << endl;
+    return;
+  }
+
+  out << fixed << setprecision( 3 );
+
+  if (json) {
+
+    out << "[\n";
+
+    for (unsigned int i=0; i<results.size(); i++) {
+      ScanResult &r = results[i];
+      out << "  { \"file\": " << jsonString( r.name ) << ", \"width\": " << r.width << ", \"height\": " << r.height
+          << ", \"status\": \"" << (r.found ? "ok" : "nogrid") << "\"";
+      if (r.found)
+        out << ", \"lines\": [ { \"angle\": " << r.angle[0] << ", \"wavelength\": " << r.wavelength[0] << " },"
+            << " { \"angle\": " << r.angle[1] << ", \"wavelength\": " << r.wavelength[1] << " } ]";
+      out << " }" << (i+1 < results.size() ? "," : "") << "\n";
+    }
+
+    out << "]\n";
+
+  } else {
+
+    out << "file,width,height,status,angle0,wavelength0,angle1,wavelength1\n";
+
+    for (unsigned int i=0; i<results.size(); i++) {
+      ScanResult &r = results[i];
+      out << csvField( r.name ) << "," << r.width << "," << r.height << "," << (r.found ? "ok" : "nogrid");
+      if (r.found)
+        out << "," << r.angle[0] << "," << r.wavelength[0] << "," << r.angle[1] << "," << r.wavelength[1];
+      else
+        out << ",,,,";
+      out << "\n";
+    }
+  }
+}
+
+
+
+// Remove the grid from 'scan' with a workspace from 'workspaces', or
+// tile by tile if it is wider or taller than 'tileSize' (if not 0)
+
+template <class Real>
+static void deGrid( Scan &scan, ScanResult &result, WorkspacePool< BasicCompute<Real> > &workspaces,
+                    int tileSize, bool realFFT, int threads, GridRemoval removal, Trace *trace )
+
+{
+  result.width = scan.width;
+  result.height = scan.height;
+
+  scan.cleaned.resize( scan.values.size() );
+
+  if (tileSize > 0 && (scan.width > tileSize || scan.height > tileSize)) {
+
+    scan.rgb.clear(); // tiles are grey only
+
+    TiledCompute<Real> tiled( scan.width, scan.height, realFFT, threads );
+    tiled.tileSize = tileSize;
+    tiled.gridRemoval = removal;
+    tiled.trace = trace;
+
+    result.found = tiled.computeSolution( scan.values.data(), scan.cleaned.data() );
+
+    for (int g=0; g<2; g++) {
+      result.angle[g] = tiled.angle[g];
+      result.wavelength[g] = tiled.wavelength[g];
+    }
+
+    return;
+  }
+
+  BasicCompute<Real> *c = workspaces.acquire( scan.width, scan.height );
+
+  bool colour = !scan.rgb.empty();
+
+  if (colour)
+    c->loadColourImage( scan.rgb.data(), 3 );
+  else
+    c->loadImage( scan.values.data(), 1 );
+
+  result.found = c->computeSolution();
+
+  if (result.found)
+    for (int g=0; g<2; g++) {
+      c->gridLine( g, result.angle[g], result.wavelength[g] );
+      if (!isfinite( result.wavelength[g] ) || result.wavelength[g] <= 0)
+        result.found = false; // peaks with no spacing between them: noise, not a grid
+    }
+
+  if (result.found) {
+
+    if (colour)
+      scan.cleaned.assign( c->colourResult, c->colourResult + scan.rgb.size() );
+    else
+      for (unsigned int i=0; i<scan.cleaned.size(); i++)
+        scan.cleaned[i] = c->toSample( abs( c->result->a[i] ) );
+
+  } else
+    scan.cleaned = colour ? scan.rgb : scan.values; // nothing to remove, or no grid to trust
+
+  workspaces.release( c );
+}
+
+
+// The de-gridding stage: 'numWorkers' threads take scans from 'loaded'
+// and pass them to 'cleaned'.  Returns the total de-gridding time
+// summed over the workers, and the number of workspaces made.
+
+template <class Real>
+static double runWorkers( int numWorkers, bool realFFT, int threadsPerWorker, int tileSize,
+                          GridRemoval removal, Trace *trace,
+                          BoundedQueue<Scan *> &loaded, BoundedQueue<Scan *> &cleaned,
+                          vector<ScanResult> &results, int &numWorkspaces )
+
+{
+  WorkspacePool< BasicCompute<Real> > workspaces( realFFT, threadsPerWorker, removal, trace );
+
+  vector<double> workerSeconds( numWorkers, 0 );
+  vector<thread> workers;
+
+  for (int w=0; w<numWorkers; w++)
+    workers.push_back( thread( [&,w]() {
+      Scan *scan;
+      while (loaded.get( scan )) {
+        auto start = chrono::steady_clock::now();
+        {
+          TraceScope s( trace, "de-grid scan" );
+          deGrid( *scan, results[ scan->index ], workspaces, tileSize, realFFT, threadsPerWorker, removal, trace );
+        }
+        workerSeconds[w] += chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+        cleaned.put( scan );
+      }
+    } ) );
+
+  for (int w=0; w<numWorkers; w++)
+    workers[w].join();
+
+  numWorkspaces = workspaces.numCreated;
+
+  double seconds = 0;
+  for (int w=0; w<numWorkers; w++)
+    seconds += workerSeconds[w];
+
+  return seconds;
+}
+
+
+
+static void usage()
+
+{
+  cerr << "usage: batch <input dir> <output dir> [-w workers] [-t threads per worker]"
+       << " [-l loaders] [-e encoders] [-s] [-c] [-j] [-T tile size] [-C] [-N]"
+       << " [-p summary file] [-P trace file]" << endl;
+  exit(1);
+}
+
+
+int main( int argc, char **argv )
+
+{
+  if (argc < 3)
+    usage();
+
+  string inDir  = argv[1];
+  string outDir = argv[2];
+
+  int numWorkers = max( (int) thread::hardware_concurrency(), 1 );
+  int threadsPerWorker = 1;
+  int numLoaders = 2;
+  int numEncoders = 2;
+  bool singlePrecision = false;
+  bool realFFT = true;
+  bool json = false;
+  int tileSize = 0;
+  bool colour = false;
+  GridRemoval removal = SPATIAL_REMOVAL;
+  string summaryFile, traceFile;
+
+  for (int i=3; i<argc; i++) {
+    string opt = argv[i];
+    if (opt == "-w" && i+1 < argc)
+      numWorkers = max( atoi( argv[++i] ), 1 );
+    else if (opt == "-t" && i+1 < argc)
+      threadsPerWorker = max( atoi( argv[++i] ), 1 );
+    else if (opt == "-l" && i+1 < argc)
+      numLoaders = max( atoi( argv[++i] ), 1 );
+    else if (opt == "-e" && i+1 < argc)
+      numEncoders = max( atoi( argv[++i] ), 1 );
+    else if (opt == "-s")
+      singlePrecision = true;
+    else if (opt == "-c")
+      realFFT = false;
+    else if (opt == "-j")
+      json = true;
+    else if (opt == "-C")
+      colour = true;
+    else if (opt == "-N")
+      removal = NOTCH_REMOVAL;
+    else if (opt == "-p" && i+1 < argc)
+      summaryFile = argv[++i];
+    else if (opt == "-P" && i+1 < argc)
+      traceFile = argv[++i];
+    else if (opt == "-T" && i+1 < argc)
+      tileSize = max( atoi( argv[++i] ), 0 );
+    else
+      usage();
+  }
+
+  // Find the scans
+
+  vector<string> names;
+
+  DIR *dir = opendir( inDir.c_str() );
+  if (dir == NULL) {
+    cerr << "can't read directory " << inDir << endl;
+    exit(1);
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir( dir )) != NULL) {
+    string name = entry->d_name;
+    if (name.size() > 4) {
+      string ext = name.substr( name.size() - 4 );
+      if (ext == ".pgm" || ext == ".ppm" || ext == ".pam")
+        names.push_back( name );
+    }
+  }
+  closedir( dir );
+
+  sort( names.begin(), names.end() );
+
+  vector<ScanResult> results( names.size() );
+  for (unsigned int i=0; i<names.size(); i++)
+    results[i].name = names[i];
+
+  // Run the pipeline.  Queues hold a few scans per worker, which
+  // bounds the memory in flight.
+
+  BoundedQueue<Scan *> loaded( 2 * numWorkers );
+  BoundedQueue<Scan *> cleaned( 2 * numWorkers );
+
+  atomic<int> nextName( 0 );
+  atomic<int> numFailed( 0 );
+  atomic<int> loadersLeft( numLoaders );
+
+  Trace *trace = (summaryFile != "" || traceFile != "") ? new Trace( traceFile != "" ) : NULL;
+
+  auto start = chrono::steady_clock::now();
+
+  vector<thread> loaders;
+  for (int i=0; i<numLoaders; i++)
+    loaders.push_back( thread( [&]() {
+      int n;
+      while ((n = nextName++) < (int) names.size()) {
+        Scan *scan = new Scan();
+        scan->index = n;
+        scan->inPath  = inDir + "/" + names[n];
+        scan->outPath = outDir + "/" + names[n].substr( 0, names[n].size() - 4 ); // writeScan() adds the extension
+        bool read;
+        {
+          TraceScope s( trace, "load scan" );
+          read = readScan( *scan, colour );
+        }
+        if (read)
+          loaded.put( scan );
+        else {
+          cerr << "can't read " << scan->inPath << endl;
+          numFailed++;
+          delete scan;
+        }
+      }
+      if (--loadersLeft == 0)
+        loaded.close();
+    } ) );
+
+  vector<thread> encoders;
+  for (int i=0; i<numEncoders; i++)
+    encoders.push_back( thread( [&]() {
+      Scan *scan;
+      while (cleaned.get( scan )) {
+        bool written;
+        {
+          TraceScope s( trace, "write scan" );
+          written = writeScan( *scan );
+        }
+        if (!written) {
+          cerr << "can't write " << scan->outPath << endl;
+          numFailed++;
+        }
+        delete scan;
+      }
+    } ) );
+
+  // De-gridding stage
+
+  int numWorkspaces;
+  double deGridSeconds;
+
+  if (singlePrecision)
+    deGridSeconds = runWorkers<float>( numWorkers, realFFT, threadsPerWorker, tileSize, removal, trace,
+                                       loaded, cleaned, results, numWorkspaces );
+  else
+    deGridSeconds = runWorkers<double>( numWorkers, realFFT, threadsPerWorker, tileSize, removal, trace,
+                                        loaded, cleaned, results, numWorkspaces );
+
+  cleaned.close();
+
+  for (unsigned int i=0; i<loaders.size(); i++)
+    loaders[i].join();
+  for (unsigned int i=0; i<encoders.size(); i++)
+    encoders[i].join();
+
+  double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+  writeResults( outDir + (json ? "/grid.json" : "/grid.csv"), results, json );
+
+  if (summaryFile != "" && !trace->writeSummary( summaryFile ))
+    cerr << "can't write " << summaryFile << endl;
+
+  if (traceFile != "" && !trace->writeChromeTrace( traceFile ))
+    cerr << "can't write " << traceFile << endl;
+
+  delete trace;
+
+  int numDone = 0;
+  int numNoGrid = 0;
+  for (unsigned int i=0; i<results.size(); i++)
+    if (results[i].width > 0) {
+      numDone++;
+      if (!results[i].found)
+        numNoGrid++;
+    }
+
+  cout << numDone << " scans in " << seconds << " s: " << numDone / seconds << " scans/s"
+       << " (de-grid " << deGridSeconds << " s";
+  if (numDone > 0)
+    cout << ", " << deGridSeconds / numDone * 1000 << " ms/scan";
+  cout << ", " << numWorkspaces << " workspaces)" << endl;
+
+  if (numNoGrid > 0)
+    cout << numNoGrid << " scans with no grid found" << endl;
+
+  if (numFailed > 0)
+    cout << numFailed << " scans failed" << endl;
+
+  return (numFailed > 0) ? 1 : 0;
+}
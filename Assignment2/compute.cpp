@@ -28,20 +28,14 @@ bool increasingDistance( PolarPeak &a, PolarPeak &b ) {
   return a.dist < b.dist;
 }
 
-//sorting function for sorting distances between peaks
-int distSort(const void *a, const void *b) {
-    float difference = (*(float*)a - *(float*)b);
-
-    if (difference > 0) {
-        return 1;
-    } else if (difference < 0) {
-        return -1;
-    } else {
-        return 0;
-    }
+// Order array positions as a scan with x in the outer loop
+
+bool increasingPosition( const ArrayPos &a, const ArrayPos &b ) {
+  return (a.x != b.x) ? a.x < b.x : a.y < b.y;
 }
 
 
+
 // Remove the grid from the global 'image'.
 //
 // Determine the direction and spacing of the grid lines.
@@ -54,30 +48,201 @@ int distSort(const void *a, const void *b) {
 
 
 
-void Compute::computeSolution()
+// Run the stages of grid removal that are out of date.  The stages
+// and what each depends on are:
+//
+//   FORWARD_FT  'imageFT' from 'image'                     (step 1)
+//   MAXIMUM     'squaredMagnitudes' and their maximum      (step 2)
+//   PEAKS       the peaks and, for SPATIAL_REMOVAL,        (step 3)
+//               'gridFT', from MAXIMUM,
+//               'thresholdPercentage' and 'maxPeaks'
+//   LINES       'lines', from PEAKS and 'lineEstimator',   (step 4)
+//               unless 'fixedLines'
+//   GRID        'grid', from PEAKS, for SPATIAL_REMOVAL    (step 5)
+//   RESULT      'result', from LINES, GRID,                (step 6)
+//               'gridLineMagnitudeThreshold',
+//               'interpolateAroundGridLines' and 'gridFill',
+//               or for NOTCH_REMOVAL from PEAKS, LINES
+//               and 'notchWidth'
+//
+// Parameters are compared with the values each stage last used, so
+// after changing one, computeSolution() reruns only the stages
+// downstream of it.  Call imageChanged() after modifying 'image'.
+
+template <class Real>
+bool BasicCompute<Real>::computeSolution()
+
+{
+  if (valid[PEAKS] && maxPeaks != peaksMaxPeaks)
+    invalidate( PEAKS );
+
+  if (valid[PEAKS] && thresholdPercentage != peaksThresholdPercentage) {
+    float threshold2 = thresholdPercentage * thresholdPercentage * maxMag2;
+    if (maxRejectedMag2 < threshold2 && threshold2 <= minKeptMag2)
+      peaksThresholdPercentage = thresholdPercentage; // same components pass the new threshold
+    else
+      invalidate( PEAKS );
+  }
+
+  if (valid[PEAKS] && gridRemoval == SPATIAL_REMOVAL && peaksGridRemoval != SPATIAL_REMOVAL)
+    invalidate( PEAKS ); // 'gridFT' wasn't kept
+
+  if (valid[LINES] && lineEstimator != linesEstimator)
+    invalidate( LINES );
+
+  if (valid[RESULT] && (gridRemoval != resultGridRemoval ||
+                        (gridRemoval == SPATIAL_REMOVAL &&
+                         (gridLineMagnitudeThreshold != resultMagnitudeThreshold ||
+                          interpolateAroundGridLines != resultInterpolate ||
+                          gridFill != resultGridFill)) ||
+                        (gridRemoval == NOTCH_REMOVAL && notchWidth != resultNotchWidth)))
+    invalidate( RESULT );
+
+  TraceScope scope( trace, "computeSolution" );
+
+  if (!valid[FORWARD_FT]) {
+    TraceScope s( trace, "1 forward FT" );
+    transformImage();
+    valid[FORWARD_FT] = true;
+  }
+
+  if (!valid[MAXIMUM]) {
+    TraceScope s( trace, "2 maximum" );
+    findMaximum();
+    valid[MAXIMUM] = true;
+  }
+
+  if (!valid[PEAKS]) {
+    TraceScope s( trace, "3 peaks" );
+    findPeaks();
+    peaksThresholdPercentage = thresholdPercentage;
+    peaksMaxPeaks = maxPeaks;
+    peaksGridRemoval = gridRemoval;
+    valid[PEAKS] = true;
+    if (trace != NULL)
+      trace->count( "peaks", peakPositions.size() );
+  }
+
+  if (!valid[LINES]) {
+    TraceScope s( trace, "4 lines" );
+    if (!fixedLines && !findLines())
+      return false;
+    linesEstimator = lineEstimator;
+    valid[LINES] = true;
+  }
+
+  if (!valid[GRID] && gridRemoval == SPATIAL_REMOVAL) {
+    TraceScope s( trace, "5 inverse FT" );
+    transformGrid();
+    valid[GRID] = true;
+  }
+
+  if (!valid[RESULT]) {
+    TraceScope s( trace, gridRemoval == NOTCH_REMOVAL ? "6 notch filter" : "6 remove grid" );
+    if (gridRemoval == NOTCH_REMOVAL)
+      notchFilter();
+    else
+      removeGrid();
+    resultMagnitudeThreshold = gridLineMagnitudeThreshold;
+    resultInterpolate = interpolateAroundGridLines;
+    resultGridFill = gridFill;
+    resultGridRemoval = gridRemoval;
+    resultNotchWidth = notchWidth;
+    valid[RESULT] = true;
+  }
+
+  reportLines();
+
+  return true;
+}
+
+
+template <class Real>
+void BasicCompute<Real>::invalidate( Stage stage )
+
+{
+  valid[stage] = false;
+
+  switch (stage) {
+  case FORWARD_FT: invalidate( MAXIMUM ); break;
+  case MAXIMUM:    invalidate( PEAKS ); break;
+  case PEAKS:      invalidate( LINES ); invalidate( GRID ); break;
+  case LINES:
+  case GRID:       invalidate( RESULT ); break;
+  default:         break;
+  }
+}
+
+
+template <class Real>
+void BasicCompute<Real>::transformImage()
 
 {
   // 1. Compute the FT of the image.  Store it in 'imageFT'.
   // 
   // [0 marks]
 
-  forwardFT (image, imageFT); //Fourier Transform (FT) src --> dst
+  // With 'realFFT', only the half spectrum is computed and scanned
+  // below.  The other half mirrors it with the same magnitudes, so the
+  // maximum is the same, and each peak found also stands for its
+  // mirror image.
+
+  if (realFFT)
+    forwardRealFT( image, imageFT );
+  else
+    forwardFT (image, imageFT); //Fourier Transform (FT) src --> dst
+}
+
 
+template <class Real>
+void BasicCompute<Real>::findMaximum()
+
+{
   // 2. Find the maximum magnitude, excluding the DC component in [0,0].
   //
   // [1 mark]
 
-  float maxMag = 0; 
-  for (int i = 1; i < dimX; i++){ //for each pixel in imageFT (except 0,0)
-    for (int j = 1; j < dimY; j++){
+  // The squared magnitudes are computed once, in the same pass that
+  // finds the maximum, and cached in 'squaredMagnitudes' for step 3.
+  // Comparing squared magnitudes against a squared threshold avoids a
+  // sqrt per element.  Each band of columns is scanned row by row, so
+  // the inner loops run over contiguous memory and vectorize.
+  //
+  // Each band finds its own maximum, then the bands' maxima are
+  // combined.
+
+  int spectrumX = imageFT->dimX; // dimX, or dimX/2+1 for a half spectrum
+
+  int bands = columnBands( 1, spectrumX );
 
-      float currMag = abs((*imageFT)(i, j)); //find magnitude of pixel
+  vector<float> bandMax( bands, 0 );
 
-      if (currMag > maxMag) //if pixel is new maximum magnitude, update it
-          maxMag = currMag;
+  forColumnBands( 1, spectrumX, [&]( int band, int x0, int x1 ) {
+    float maxMag2 = 0;
+    for (int j = 1; j < dimY; j++){ //for each pixel in imageFT (except 0,0)
+
+      const Real *ft = (const Real *) &(*imageFT)(x0, j); // interleaved real, imaginary
+      float *mag2 = squaredMagnitudes + x0 + spectrumX * j;
+
+      for (int i = 0; i < x1 - x0; i++)
+        mag2[i] = ft[2*i] * ft[2*i] + ft[2*i+1] * ft[2*i+1];
+
+      for (int i = 0; i < x1 - x0; i++) //if pixel is new maximum magnitude, update it
+        maxMag2 = max( maxMag2, mag2[i] );
     }
-  }
+    bandMax[band] = maxMag2;
+  });
+
+  maxMag2 = 0; 
+  for (int b = 0; b < bands; b++)
+    maxMag2 = max( maxMag2, bandMax[b] );
+}
 
+
+template <class Real>
+void BasicCompute<Real>::findPeaks()
+
+{
   // 3. Set to zero the components of 'imageFT' that have magnitude
   //    less than 40% the maximum magnitude.  Store this new FT in
   //    'gridFT'.  Record in a list the (x,y) locations of the
@@ -85,27 +250,93 @@ void Compute::computeSolution()
   //
   // [1 mark]
 
-  float threshold = thresholdPercentage * maxMag;
+  // Only the 'maxPeaks' strongest peaks are recorded, so a low
+  // threshold on a noisy scan can't make the list huge; 'gridFT' still
+  // keeps every component above the threshold.  Each band keeps its
+  // own strongest peaks and these are then merged.
+  //
+  // The weakest component kept and the strongest one dropped are also
+  // recorded: any threshold between them selects the same components,
+  // so computeSolution() needn't rerun this stage for it.
+  //
+  // NOTCH_REMOVAL needs only the peaks, so 'gridFT' is left alone.
 
-  vector<ArrayPos> peakPositions; // (x,y) positions of peaks
+  bool keepGridFT = (gridRemoval == SPATIAL_REMOVAL);
+  if (keepGridFT)
+    allocateGrid();
 
-  for (int i = 1; i < dimX; i++){ //for each pixel in imageFT (except 0,0)
-    for (int j = 1; j < dimY; j++){
+  int spectrumX = imageFT->dimX;
+  int bands = columnBands( 1, spectrumX );
 
-        float currMag = abs((*imageFT)(i, j)); //find magnitude of pixel
+  float threshold2 = thresholdPercentage * thresholdPercentage * maxMag2;
 
-        if (currMag >= threshold){    //if above threshold, copy pixel to gridFT & record location
-          (*gridFT)(i,j) = (*imageFT)(i,j);
-          peakPositions.push_back({i,j}); //record array position
-        }
-        else    
-          (*gridFT)(i,j) = 0;   //else clear pixel to 0 on gridFT
+  vector<StrongestPeaks> bandPeaks( bands, StrongestPeaks( maxPeaks ) );
+  vector<float> bandMinKept( bands, maxMag2 );
+  vector<float> bandMaxRejected( bands, 0 );
+
+  forColumnBands( 1, spectrumX, [&]( int band, int x0, int x1 ) {
+    StrongestPeaks &strongest = bandPeaks[band];
+    float minKept = bandMinKept[band];
+    float maxRejected = bandMaxRejected[band];
+
+    for (int j = 1; j < dimY; j++){ //for each pixel in imageFT (except 0,0)
+
+      float *mag2 = squaredMagnitudes + spectrumX * j;
+
+      for (int i = x0; i < x1; i++){
+
+          if (mag2[i] >= threshold2){    //if above threshold, copy pixel to gridFT & record location
+            if (keepGridFT)
+              (*gridFT)(i,j) = (*imageFT)(i,j);
+            strongest.offer( mag2[i], i, j ); //record array position
+            minKept = min( minKept, mag2[i] );
+          }
+          else {
+            if (keepGridFT)
+              (*gridFT)(i,j) = 0;   //else clear pixel to 0 on gridFT
+            maxRejected = max( maxRejected, mag2[i] );
+          }
+
+      } 
+    }   //end of nested i j loop
+
+    bandMinKept[band] = minKept;
+    bandMaxRejected[band] = maxRejected;
+  });
+
+  minKeptMag2 = maxMag2;
+  maxRejectedMag2 = 0;
+  for (int b = 0; b < bands; b++) {
+    minKeptMag2 = min( minKeptMag2, bandMinKept[b] );
+    maxRejectedMag2 = max( maxRejectedMag2, bandMaxRejected[b] );
+  }
+
+  StrongestPeaks strongest( maxPeaks );
+  for (int b = 0; b < bands; b++)
+    strongest.merge( bandPeaks[b] );
+
+  peakPositions.clear();
 
-    } 
-  }   //end of nested i j loop
+  for (unsigned int p = 0; p < strongest.size(); p++) {
 
-  (*gridFT)(0,0) = (*imageFT)(0,0); // just in case the DC component is too small
+    ArrayPos pos = strongest.position( p );
+    peakPositions.push_back( pos );
 
+    if (realFFT && 2*pos.x != dimX) // the mirror peak, unless it is in the half spectrum too
+      peakPositions.push_back({dimX-pos.x, dimY-pos.y});
+  }
+
+  if (keepGridFT)
+    (*gridFT)(0,0) = (*imageFT)(0,0); // just in case the DC component is too small
+
+  sort( peakPositions.begin(), peakPositions.end(), increasingPosition ); // same order as a scan of the full spectrum
+}
+
+
+template <class Real>
+bool BasicCompute<Real>::findLines()
+
+{
   // 4. From the peaks, find the angles in the FT of the two principal
   //    grid line directions and, for each such line direction, find
   //    the spacing in the FT between the peaks corresponding to that
@@ -118,7 +349,11 @@ void Compute::computeSolution()
   //    two (angle,distance) values corresponding to the two grid line
   //    directions.
   
-  PolarPeak lines[2] = { PolarPeak( 0,0 ), PolarPeak( 0,0 ) };
+  lines[0] = lines[1] = PolarPeak( 0,0 );
+  lineConfidence[0] = lineConfidence[1] = -1;
+
+  if (lineEstimator == HISTOGRAM_ESTIMATOR)
+    return findLinesFromHistograms();
 
   // 4a. Gather in 'peaks' the angle and distance of each peak in
   //     'peakPositions'.  Take into account the quadrant that the
@@ -159,8 +394,9 @@ void Compute::computeSolution()
 
   
   if (peaks.size() < 2) {
-    cerr << "Not enough peaks detected" << endl;
-    return;
+    if (printLines)
+      cerr << "Not enough peaks detected" << endl;
+    return false;
    }
     
   // 4b. Split the peaks found in 4a into two groups such that the
@@ -246,7 +482,7 @@ void Compute::computeSolution()
       sort(collinearPeaks[i].begin(), collinearPeaks[i].end(), increasingDistance);
       //we now have a sorted array of all distances
 
-      float disArr[collinearPeaks[i].size()]; //make a new array to hold distances between
+      vector<float> disArr( collinearPeaks[i].size() + 1 ); //make a new array to hold distances between (+1 so an empty group reads 0)
       int  disArrSize = 0; //size
       int index = 0;
       for (int j = 1; j < collinearPeaks[i].size(); j++){//for all distances in the group
@@ -260,7 +496,7 @@ void Compute::computeSolution()
       }
     }
       //sort array by size
-      qsort(disArr, disArrSize, sizeof(float), distSort);
+      sort(disArr.begin(), disArr.begin() + disArrSize);
 
     //find and store median
     int middle = disArrSize/2;
@@ -273,12 +509,200 @@ void Compute::computeSolution()
   lines[0] = PolarPeak( peakAngles[0] , interPeakDistances[0] );
   lines[1] = PolarPeak( peakAngles[1] , interPeakDistances[1] );
 
+  return true;
+}
+
+
+// Find the lines from histograms of the peaks' energy (squared
+// magnitude), in time linear in the number of peaks and with no
+// sorting:
+//
+//   - The energy of each peak goes into a histogram of direction, in
+//     1 degree bins over [0,180).  A peak and its opposite at 180
+//     degrees fall in the same bin.  The two strongest directions at
+//     least 'tolerance' apart, refined between bins, give the angles.
+//
+//   - For each direction, the energy of the peaks within 'tolerance'
+//     of it goes into a histogram of distance from the origin, in 1
+//     pixel bins.  The harmonics of a grid are evenly spaced, so the
+//     autocorrelation of that histogram peaks at the spacing.  Its size
+//     depends on the image size, not on the number of peaks.
+//
+// lineConfidence[] is, for each direction, the fraction of all peak
+// energy in that direction times the autocorrelation at the spacing
+// relative to that at 0: near 1 for a clean grid, near 0 for noise.
+
+template <class Real>
+bool BasicCompute<Real>::findLinesFromHistograms()
+
+{
+  const float minPeakDist = 20;        // as in step 4a
+  const int angleBins = 180;
+  const int tolerance = 20;            // bins, so 20 degrees, as in step 4b
+  const int minSpacing = 3;            // as in step 4d, which discards spacings <= 2
+
+  int radialBins = (int) ceil( sqrt( (float) (dimX*dimX + dimY*dimY) ) / 2 ) + 2;
+
+  // Direction, distance and energy of a peak, or false if it is too
+  // close to the origin
+
+  auto polar = [&]( ArrayPos &p, int &bin, float &dist, float &energy ) {
+
+    int u = (p.x >= dimX/2) ? p.x - dimX : p.x; // frequencies from array positions
+    int v = (p.y >= dimY/2) ? p.y - dimY : p.y;
+
+    dist = sqrt( (float) (u*u + v*v) );
+    if (dist <= minPeakDist)
+      return false;
+
+    float angle = atan2( (float) v, (float) u );
+    if (angle < 0)
+      angle += M_PI;
+    bin = min( (int) (angle / M_PI * angleBins), angleBins-1 );
+
+    // The half spectrum holds the mirror image of peaks beyond it
+
+    int x = p.x, y = p.y;
+    int spectrumX = imageFT->dimX;
+    if (x >= spectrumX) {
+      x = dimX - x;
+      y = (dimY - y) % dimY;
+    }
+    energy = squaredMagnitudes[ x + spectrumX * y ];
+
+    return true;
+  };
+
+  auto angleApart = [&]( int a, int b ) {
+    int d = abs( a - b );
+    return min( d, angleBins - d );
+  };
+
+  // Direction histogram
+
+  vector<float> angular( angleBins, 0 );
+  float totalEnergy = 0;
+
+  for (unsigned int i=0; i<peakPositions.size(); i++) {
+    int bin;
+    float dist, energy;
+    if (polar( peakPositions[i], bin, dist, energy )) {
+      angular[bin] += energy;
+      totalEnergy += energy;
+    }
+  }
+
+  vector<float> smoothed( angleBins );
+  for (int b=0; b<angleBins; b++)
+    smoothed[b] = angular[ (b+angleBins-1) % angleBins ] + angular[b] + angular[ (b+1) % angleBins ];
+
+  int best[2] = { -1, -1 };
+
+  for (int b=0; b<angleBins; b++)
+    if (best[0] == -1 || smoothed[b] > smoothed[ best[0] ])
+      best[0] = b;
+
+  for (int b=0; b<angleBins; b++)
+    if (angleApart( b, best[0] ) > tolerance && (best[1] == -1 || smoothed[b] > smoothed[ best[1] ]))
+      best[1] = b;
+
+  if (totalEnergy == 0 || best[1] == -1 || smoothed[ best[1] ] == 0) {
+    if (printLines)
+      cerr << "Not enough peaks detected" << endl;
+    return false;
+  }
+
+  // Distance histograms of the peaks near each direction
+
+  vector<float> radial[2];
+  float directionEnergy[2] = { 0, 0 };
+
+  for (int g=0; g<2; g++)
+    radial[g].assign( radialBins, 0 );
+
+  for (unsigned int i=0; i<peakPositions.size(); i++) {
+    int bin;
+    float dist, energy;
+    if (!polar( peakPositions[i], bin, dist, energy ))
+      continue;
+    int g = (angleApart( bin, best[0] ) <= angleApart( bin, best[1] )) ? 0 : 1;
+    if (angleApart( bin, best[g] ) <= tolerance) {
+      radial[g][ (int) rint( dist ) ] += energy;
+      directionEnergy[g] += energy;
+    }
+  }
+
+  for (int g=0; g<2; g++) {
+
+    // Angle, refined by a parabola through the neighbouring bins
+
+    float left  = smoothed[ (best[g]+angleBins-1) % angleBins ];
+    float mid   = smoothed[ best[g] ];
+    float right = smoothed[ (best[g]+1) % angleBins ];
+    float denom = left - 2*mid + right;
+    float offset = (denom < 0) ? 0.5f * (left - right) / denom : 0;
+
+    float angle = (best[g] + 0.5f + offset) * M_PI / angleBins;
+    if (angle < 0)
+      angle += M_PI;
+    else if (angle >= M_PI)
+      angle -= M_PI;
+
+    // Spacing, from the autocorrelation of the distance histogram
+
+    vector<float> &h = radial[g];
+    vector<float> autocorrelation( radialBins, 0 );
+
+    for (int lag=0; lag<radialBins; lag++)
+      for (int r=0; r+lag<radialBins; r++)
+        autocorrelation[lag] += h[r] * h[r+lag];
+
+    int spacing = -1;
+    for (int lag=minSpacing; lag<radialBins; lag++)
+      if (spacing == -1 || autocorrelation[lag] > autocorrelation[spacing])
+        spacing = lag;
+
+    if (autocorrelation[0] == 0 || autocorrelation[spacing] == 0) {
+      if (printLines)
+        cerr << "Not enough peaks detected" << endl;
+      return false;
+    }
+
+    float refined = spacing;
+    if (spacing > minSpacing && spacing < radialBins-1) {
+      float a = autocorrelation[spacing-1], b = autocorrelation[spacing], c = autocorrelation[spacing+1];
+      float d = a - 2*b + c;
+      if (d < 0)
+        refined += 0.5f * (a - c) / d;
+    }
+
+    lines[g] = PolarPeak( angle, refined );
+    lineConfidence[g] = (directionEnergy[g] / totalEnergy) * (autocorrelation[spacing] / autocorrelation[0]);
+  }
+
+  return true;
+}
+
+
+template <class Real>
+void BasicCompute<Real>::transformGrid()
+
+{
   // 5. Apply the inverse FT to 'gridFT' to get 'grid'.
   //
   //    [0 marks]
 
-  inverseFT(gridFT, grid);  //Invserse Fourier Transform  src --> dst
+  if (realFFT)
+    inverseRealFT( gridFT, grid );
+  else
+    inverseFT(gridFT, grid);  //Invserse Fourier Transform  src --> dst
+}
+
 
+template <class Real>
+void BasicCompute<Real>::removeGrid()
+
+{
   // 6. For each (x,y) location in 'grid' that has a bright pixel of
   //    value > gridLineMagnitudeThreshold (i.e. is one of the grid
   //    lines), set the corresponding pixel in the 'result' to the
@@ -301,22 +725,423 @@ void Compute::computeSolution()
   //
   //    [1 mark]
 
-  for (int x=0; x<image->dimX; x++){    //for every pixel
-    for (int y=0; y<image->dimY; y++){ 
-      (*result)(x,y) = (*image)(x,y); //fill in result before its modified
-
-      if ( abs((*grid)(x,y)) > (gridLineMagnitudeThreshold)){ //if pixel is on the grid, replace it
-        
-      if (interpolateAroundGridLines){ //interpolate pixel
-        (*result)(x,y) = averageOfNeighbours(x, y, image, grid, lines); //lines is in radians
-     }  
-      else{ //do not interpolate, just set to 0
-        (*result)(x,y) = 0;
+  // The grid-line pixels are marked once, in the bit mask 'gridMask',
+  // and 'result' is then filled from the mask.  With 'gridFill' set to
+  // PERPENDICULAR_FILL this gives the same values as calling
+  // averageOfNeighbours() for each grid-line pixel.
+
+  {
+    TraceScope s( trace, "6 grid mask" );
+    buildGridMask();
+  }
+
+  failedFills = 0;
+
+  {
+    TraceScope s( trace, "6 fill" );
+    if (interpolateAroundGridLines && gridFill == DISTANCE_FILL)
+      distanceFill();
+    else
+      perpendicularFill();
+  }
+
+  if (trace != NULL) {
+    long long gridPixels = 0;
+    for (size_t i=0; i<maskWords * (size_t) dimY; i++)
+      gridPixels += __builtin_popcountll( gridMask[i] );
+    trace->count( "grid pixels", gridPixels );
+    trace->count( "failed fills", failedFills );
+  }
+}
+
+
+// Step 6 for NOTCH_REMOVAL: multiply a copy of 'imageFT' by a notch,
+// 1 - exp( -r^2 / (2 notchWidth^2) ), around each peak, then invert it
+// into 'result'.  Peaks within 20 of the origin, which step 4a also
+// ignores, are mostly the image itself and are kept.
+//
+// The notches are smooth, so they don't ring the way zeroing the peaks
+// would.  The peaks come in mirror pairs, so the filtered spectrum is
+// still Hermitian; with 'realFFT' only the notch elements in the half
+// spectrum are applied and each pair's mirror notch covers the rest.
+//
+// The copy is filtered in 'result' itself and transformed in place for
+// the complex FFT, or in the c2r transform's scratch input otherwise.
+//
+// A colour result is the colour image with, in every channel, the
+// change that the filter made to the luminance.
+
+template <class Real>
+void BasicCompute<Real>::notchFilter()
+
+{
+  typedef typename FFTW<Real>::Complex Complex;
+
+  const float minPeakDist = 20;
+
+  int spectrumX = imageFT->dimX;
+  int n = dimX * dimY;
+  int halfN = spectrumX * dimY;
+
+  // One notch, which multiplies elements up to 'reach' away
+
+  int reach = (int) ceil( 3 * notchWidth );
+  int side = 2 * reach + 1;
+
+  vector<Real> notch( side * side );
+
+  for (int dy=-reach; dy<=reach; dy++)
+    for (int dx=-reach; dx<=reach; dx++)
+      notch[ (dx+reach) + side * (dy+reach) ] = 1 - exp( -(dx*dx + dy*dy) / (2 * notchWidth * notchWidth) );
+
+  complex<Real> *ft = realFFT ? (complex<Real> *) FFTW<Real>::malloc( halfN * sizeof(Complex) ) : result->a;
+
+  memcpy( ft, imageFT->a, halfN * sizeof(Complex) );
+
+  for (unsigned int i=0; i<peakPositions.size(); i++) {
+
+    ArrayPos &p = peakPositions[i];
+
+    int u = (p.x >= dimX/2) ? p.x - dimX : p.x; // frequencies from array positions
+    int v = (p.y >= dimY/2) ? p.y - dimY : p.y;
+    if (u*u + v*v <= minPeakDist * minPeakDist)
+      continue;
+
+    for (int dy=-reach; dy<=reach; dy++) {
+      int y = ((p.y + dy) % dimY + dimY) % dimY;
+      for (int dx=-reach; dx<=reach; dx++) {
+        int x = ((p.x + dx) % dimX + dimX) % dimX;
+        if (x < spectrumX)
+          ft[ x + spectrumX * y ] *= notch[ (dx+reach) + side * (dy+reach) ];
+      }
+    }
+  }
+
+  Real scale = 1.0 / (float) n;
+
+  if (realFFT) {
+
+    Real *out = (Real *) FFTW<Real>::malloc( n * sizeof(Real) );
+
+    typename FFTW<Real>::Plan p = planReal( dimX, dimY, false, ft, out );
+
+    FFTW<Real>::executeC2R( p, (Complex *) ft, out );
+
+    for (int i=0; i<n; i++)
+      result->a[i] = complex<Real>( out[i] * scale, 0 );
+
+    FFTW<Real>::free( ft );
+    FFTW<Real>::free( out );
+
+  } else {
+
+    typename FFTW<Real>::Plan p = plan( dimX, dimY, FFTW_BACKWARD, ft, ft );
+
+    FFTW<Real>::executeDFT( p, (Complex *) ft, (Complex *) ft );
+
+    for (int i=0; i<n; i++)
+      result->a[i] = complex<Real>( result->a[i].real() * scale, 0 );
+  }
+
+  if (colour)
+    pool->parallelFor( dimY, [&]( int y ) {
+      for (int i=y*dimX; i<(y+1)*dimX; i++) {
+        float filtered = result->a[i].real();
+        float original = image->a[i].real();
+        for (int c=0; c<3; c++) // a magnitude, as grey results are, and |filtered| if grey
+          colourResult[3*i+c] = toSample( fabs( filtered + (colourImage[3*i+c] - original) ) );
       }
+    } );
+}
+
+
+// Make 'grid' and 'gridFT', if not already made.  A Compute made for
+// NOTCH_REMOVAL has neither until it is switched to SPATIAL_REMOVAL.
+
+template <class Real>
+void BasicCompute<Real>::allocateGrid()
+
+{
+  if (grid != NULL)
+    return;
+
+  grid = new Array( dimX, dimY );
+  gridFT = new Array( imageFT->dimX, dimY );
+}
+
+
+// Set bit (x,y) of 'gridMask' for each pixel of 'grid' with magnitude
+// above gridLineMagnitudeThreshold.  Each row of the mask is
+// 'maskWords' 64-bit words.
+
+template <class Real>
+void BasicCompute<Real>::buildGridMask()
+
+{
+  float threshold2 = gridLineMagnitudeThreshold * gridLineMagnitudeThreshold;
+
+  pool->parallelFor( dimY, [&]( int y ) {
+
+    uint64_t *maskRow = gridMask + y * (size_t) maskWords;
+    complex<Real> *gridRow = &(*grid)(0,y);
+
+    for (int w=0; w<maskWords; w++) {
+
+      uint64_t bits = 0;
+      int x0 = w * 64;
+      int n = min( 64, dimX - x0 );
+
+      for (int i=0; i<n; i++)
+        if (norm( gridRow[x0+i] ) > threshold2)
+          bits |= (uint64_t) 1 << i;
+
+      maskRow[w] = bits;
     }
+  } );
+}
+
+
+// Fill as averageOfNeighbours() does, but with the direction
+// perpendicular to each grid line worked out once for the image rather
+// than once per pixel, and the grid test a bit lookup.  The positions
+// searched are rounded from the same expression, since rint() rounds
+// halves to even and x + rint(i*dx) would differ from it at ties.
+// Rows are filled in parallel, and runs of 64 pixels with no grid line
+// are copied whole.
+
+template <class Real>
+void BasicCompute<Real>::perpendicularFill()
+
+{
+  const int distToSearch = 3;
+
+  float dirX[2], dirY[2];
+
+  float aspect = dimY / (float) dimX;
+
+  for (int l=0; l<2; l++) {
+
+    float dx = 1;
+    float dy = tanf( lines[l].angle ) / (aspect*aspect); // (include aspect ratio)
+
+    float len = sqrtf( dx*dx + dy*dy ); // make (dx,dy) unit length
+    dirX[l] = dx / len;
+    dirY[l] = dy / len;
+  }
+
+  pool->parallelFor( dimY, [&]( int y ) {
+
+    uint64_t *maskRow = gridMask + y * (size_t) maskWords;
+    size_t rowStart = y * (size_t) dimX;
+
+    for (int w=0; w<maskWords; w++) {
+
+      int x0 = w * 64;
+      int n = min( 64, dimX - x0 );
+
+      if (maskRow[w] == 0) {
+        copyPixels( rowStart + x0, n );
+        continue;
+      }
+
+      for (int i=0; i<n; i++) {
+
+        int x = x0 + i;
+
+        if (!((maskRow[w] >> i) & 1)) {
+          copyPixels( rowStart + x, 1 );
+          continue;
+        }
 
-    } //end of loop
+        int64_t ahead = -1; // pixels to fill from, or -1 if none
+        int64_t behind = -1;
+
+        for (int l=0; interpolateAroundGridLines && l<2; l++) {
+
+          for (int s=0; s<distToSearch; s++) {
+            int px = (int) rint( x + s * dirX[l] );
+            int py = (int) rint( y + s * dirY[l] );
+            if (px >= 0 && px < dimX && py >= 0 && py < dimY && !gridMasked( px, py )) {
+              ahead = px + py * (int64_t) dimX;
+              break;
+            }
+          }
+
+          for (int s=0; s<distToSearch; s++) {
+            int px = (int) rint( x - s * dirX[l] );
+            int py = (int) rint( y - s * dirY[l] );
+            if (px >= 0 && px < dimX && py >= 0 && py < dimY && !gridMasked( px, py )) {
+              behind = px + py * (int64_t) dimX;
+              break;
+            }
+          }
+
+          if (ahead != -1 || behind != -1)
+            break; // otherwise try the other grid line
+        }
+
+        fillPixel( rowStart + x, ahead, behind );
+      }
+    }
+  } );
+}
+
+
+// Fill each grid-line pixel with the value of the nearest pixel (in
+// Euclidean distance) that is not on a grid line, however wide the
+// line.  The nearest pixels come from a separable distance transform
+// (Felzenszwalb and Huttenlocher): a pass down each column finds the
+// nearest off-line pixel in that column, then a pass along each row
+// finds, for each pixel, the column whose nearest pixel is closest.
+// Both passes are parallel.
+
+template <class Real>
+void BasicCompute<Real>::distanceFill()
+
+{
+  const int none = -1;
+  const float infinity = 1e30;
+
+  vector<int> nearestRow( dimX * (size_t) dimY ); // nearest off-line row in the same column, or 'none'
+
+  forColumnBands( 0, dimX, [&]( int, int x0, int x1 ) {
+    for (int x=x0; x<x1; x++) {
+
+      int last = none;
+      for (int y=0; y<dimY; y++) {
+        if (!gridMasked( x, y ))
+          last = y;
+        nearestRow[ x + y * (size_t) dimX ] = last;
+      }
+
+      last = none;
+      for (int y=dimY-1; y>=0; y--) {
+        if (!gridMasked( x, y ))
+          last = y;
+        int &above = nearestRow[ x + y * (size_t) dimX ];
+        if (last != none && (above == none || last - y < y - above))
+          above = last;
+      }
+    }
+  } );
+
+  pool->parallelFor( dimY, [&]( int y ) {
+
+    size_t rowStart = y * (size_t) dimX;
+    int *nearestInRow = &nearestRow[ y * (size_t) dimX ];
+
+    // Lower envelope of the parabolas (x-q)^2 + f(q), where f(q) is the
+    // squared distance from (q,y) to the nearest off-line pixel in
+    // column q
+
+    vector<int> sites( dimX );          // q of each parabola in the envelope
+    vector<float> bounds( dimX + 1 );   // the envelope switches to sites[k] at bounds[k]
+    int k = -1;
+
+    for (int q=0; q<dimX; q++) {
+
+      if (nearestInRow[q] == none)
+        continue;
+
+      float fq = (float) (nearestInRow[q] - y) * (nearestInRow[q] - y);
+
+      while (true) {
+        if (k < 0) {
+          sites[0] = q;
+          bounds[0] = -infinity;
+          k = 0;
+          break;
+        }
+        int p = sites[k];
+        float fp = (float) (nearestInRow[p] - y) * (nearestInRow[p] - y);
+        float s = ((fq + q*(float)q) - (fp + p*(float)p)) / (2 * (q - p)); // where the parabolas cross
+        if (s <= bounds[k])
+          k--;
+        else {
+          k++;
+          sites[k] = q;
+          bounds[k] = s;
+          break;
+        }
+      }
+    }
+
+    if (k < 0) { // no off-line pixel in the image at all
+      for (int x=0; x<dimX; x++)
+        if (gridMasked( x, y ))
+          fillPixel( rowStart + x, -1, -1 );
+        else
+          copyPixels( rowStart + x, 1 );
+      return;
     }
+
+    bounds[k+1] = infinity;
+
+    int j = 0;
+    for (int x=0; x<dimX; x++) {
+
+      while (bounds[j+1] < x)
+        j++;
+
+      if (!gridMasked( x, y ))
+        copyPixels( rowStart + x, 1 );
+      else {
+        int q = sites[j];
+        int64_t nearest = q + nearestInRow[q] * (int64_t) dimX;
+        fillPixel( rowStart + x, nearest, nearest );
+      }
+    }
+  } );
+}
+
+
+// Pixels [i,i+n) of the results are the input pixels, in 'result' and,
+// for a colour image, in 'colourResult'
+
+template <class Real>
+void BasicCompute<Real>::copyPixels( size_t i, int n )
+
+{
+  memcpy( result->a + i, image->a + i, n * sizeof(complex<Real>) );
+
+  if (colour)
+    memcpy( colourResult + 3*i, colourImage + 3*i, 3*n );
+}
+
+
+// Pixel i of the results is the average of input pixels 'a' and 'b',
+// or one of them if the other is -1, or zero if both are
+
+template <class Real>
+void BasicCompute<Real>::fillPixel( size_t i, int64_t a, int64_t b )
+
+{
+  if (a == -1)
+    a = b;
+  else if (b == -1)
+    b = a;
+
+  if (a == -1) {
+    if (trace != NULL && interpolateAroundGridLines)
+      failedFills++;
+    result->a[i] = 0;
+    if (colour)
+      colourResult[3*i] = colourResult[3*i+1] = colourResult[3*i+2] = 0;
+    return;
+  }
+
+  result->a[i] = 0.5f * ((float) abs( image->a[b] ) + (float) abs( image->a[a] ));
+
+  if (colour) // the same average and rounding as the grey result
+    for (int c=0; c<3; c++)
+      colourResult[3*i+c] = toSample( 0.5f * ((float) colourImage[3*b+c] + (float) colourImage[3*a+c]) );
+}
+
+
+template <class Real>
+void BasicCompute<Real>::reportLines()
+
+{
   // 7. For the two grid lines recorded in 'lines', output the angle and
   //    inter-line distances.
   //
@@ -326,35 +1151,99 @@ void Compute::computeSolution()
   //    dimensions.
   //
   //    [2 marks]
+
+  if (!printLines)
+    return;
+
   for (unsigned int g=0; g<2; g++) {
 
     float angle;
     float wavelength;
-    angle = lines[g].angle;
-    if (angle > M_PI) //move angle around
-      angle = angle - M_PI;
-    //angles should be good then.
+    gridLine( g, angle, wavelength );
 
-    float dist = lines[g].dist; //distance in fourier domain
-    float u = dist * cos(angle); //decompose to u and v
-    float v = dist * sin(angle); 
-    //u and v in cycles per image dimension
+    cout << "line " << g
+	 << ": angle " << angle
+	 << ", wavelength " << wavelength << " pixels" << endl;
+  }
+}
 
-    float freqx = u / image->dimX; 
-    float freqy = v / image->dimY; 
-    //in cycles per pixel
 
-    float freq = sqrt(freqx * freqx + freqy * freqy); //return to 2D 
-    //wavelength
-    wavelength = 1 / freq;
+template <class Real>
+void BasicCompute<Real>::gridLine( int g, float &angleDegrees, float &wavelength )
 
+{
+  float angle;
+  angle = lines[g].angle;
+  if (angle > M_PI) //move angle around
+    angle = angle - M_PI;
+  //angles should be good then.
+
+  float dist = lines[g].dist; //distance in fourier domain
+  float u = dist * cos(angle); //decompose to u and v
+  float v = dist * sin(angle); 
+  //u and v in cycles per image dimension
+
+  float freqx = u / image->dimX; 
+  float freqy = v / image->dimY; 
+  //in cycles per pixel
+
+  float freq = sqrt(freqx * freqx + freqy * freqy); //return to 2D 
+  //wavelength
+  wavelength = 1 / freq;
+
+  angleDegrees = angle * 180/M_PI;
+}
 
-    cout << "line " << g
-	 << ": angle " << angle * 180/M_PI
-	 << ", wavelength " << wavelength << " pixels" << endl;
+
+template <class Real>
+void BasicCompute<Real>::loadImage( const unsigned char *values, int step, int rowStep )
+
+{
+  colour = false;
+
+  if (rowStep == 0)
+    rowStep = dimX * step;
+
+  for (int y=0; y<dimY; y++) {
+    const unsigned char *row = values + y * (size_t) rowStep;
+    for (int x=0; x<dimX; x++)
+      (*image)(x,y) = complex<Real>( row[ x * step ], 0 );
   }
+
+  imageChanged();
+}
+
+
+template <class Real>
+void BasicCompute<Real>::loadColourImage( const unsigned char *rgb, int step, int rowStep )
+
+{
+  if (rowStep == 0)
+    rowStep = dimX * step;
+
+  if (colourImage == NULL) {
+    colourImage = new unsigned char[ 3 * dimX * (size_t) dimY ];
+    colourResult = new unsigned char[ 3 * dimX * (size_t) dimY ];
+  }
+
+  colour = true;
+
+  for (int y=0; y<dimY; y++) {
+
+    const unsigned char *in = rgb + y * (size_t) rowStep;
+    unsigned char *out = colourImage + 3 * y * (size_t) dimX;
+
+    for (int x=0; x<dimX; x++) {
+      const unsigned char *p = in + x * step;
+      out[3*x] = p[0];
+      out[3*x+1] = p[1];
+      out[3*x+2] = p[2];
+      (*image)(x,y) = complex<Real>( (299 * p[0] + 587 * p[1] + 114 * p[2]) / 1000.0f, 0 ); // luminance, exactly p[0] if grey
+    }
+  }
+
+  imageChanged();
 }
-  
 
 
 
@@ -375,7 +1264,8 @@ void Compute::computeSolution()
 //
 // This isn't a great way to do this, but it works.
 
-float Compute::averageOfNeighbours( int x, int y, ComplexArray2D *image, ComplexArray2D *grid, PolarPeak (&lines)[2] )
+template <class Real>
+float BasicCompute<Real>::averageOfNeighbours( int x, int y, Array *image, Array *grid, PolarPeak (&lines)[2] )
 
 {
   float aspect = image->dimY / (float) image->dimX;
@@ -445,33 +1335,126 @@ float Compute::averageOfNeighbours( int x, int y, ComplexArray2D *image, Complex
 
 
 
-void Compute::forwardFT( ComplexArray2D *src, ComplexArray2D *dest )
+template <class Real>
+void BasicCompute<Real>::forwardFT( Array *src, Array *dest )
 
 {
-  fftw_plan p = fftw_plan_dft_2d( src->dimY, src->dimX, // dimY, then dimX is the correct order
-				  (fftw_complex *) src->a,
-				  (fftw_complex *) dest->a, 
-				  FFTW_FORWARD, FFTW_ESTIMATE );
+  typedef typename FFTW<Real>::Complex Complex;
 
-  fftw_execute( p );
+  typename FFTW<Real>::Plan p = plan( src->dimX, src->dimY, FFTW_FORWARD, src->a, dest->a );
 
-  fftw_destroy_plan( p );
+  FFTW<Real>::executeDFT( p, (Complex *) src->a, (Complex *) dest->a );
 }
 
 
-void Compute::inverseFT( ComplexArray2D *src, ComplexArray2D *dest )
+template <class Real>
+void BasicCompute<Real>::inverseFT( Array *src, Array *dest )
 
 {
-  fftw_plan p = fftw_plan_dft_2d( src->dimY, src->dimX,
-				  (fftw_complex *) src->a,
-				  (fftw_complex *) dest->a, 
-				  FFTW_BACKWARD, FFTW_ESTIMATE );
+  typedef typename FFTW<Real>::Complex Complex;
 
-  fftw_execute( p );
+  typename FFTW<Real>::Plan p = plan( src->dimX, src->dimY, FFTW_BACKWARD, src->a, dest->a );
 
-  fftw_destroy_plan( p );
+  FFTW<Real>::executeDFT( p, (Complex *) src->a, (Complex *) dest->a );
 
   // Scale inverse
   
   dest->scale( 1.0 / (float) (dest->dimX * dest->dimY) );
 }
+
+
+
+// Real-data transforms.  FFTW's r2c and c2r transforms take a plain
+// array of reals, and c2r overwrites its input, so the data passes
+// through scratch arrays.  The transforms themselves do about half the
+// work of the complex ones.
+
+template <class Real>
+void BasicCompute<Real>::forwardRealFT( Array *src, Array *dest )
+
+{
+  typedef typename FFTW<Real>::Complex Complex;
+
+  int n = src->dimX * src->dimY;
+
+  Real *in = (Real *) FFTW<Real>::malloc( n * sizeof(Real) );
+
+  for (int i=0; i<n; i++)
+    in[i] = src->a[i].real();
+
+  typename FFTW<Real>::Plan p = planReal( src->dimX, src->dimY, true, in, dest->a );
+
+  FFTW<Real>::executeR2C( p, in, (Complex *) dest->a );
+
+  FFTW<Real>::free( in );
+}
+
+
+template <class Real>
+void BasicCompute<Real>::inverseRealFT( Array *src, Array *dest )
+
+{
+  typedef typename FFTW<Real>::Complex Complex;
+
+  int n = dest->dimX * dest->dimY;
+  int halfN = src->dimX * src->dimY;
+
+  Complex *in = (Complex *) FFTW<Real>::malloc( halfN * sizeof(Complex) );
+  Real *out = (Real *) FFTW<Real>::malloc( n * sizeof(Real) );
+
+  memcpy( in, src->a, halfN * sizeof(Complex) );
+
+  typename FFTW<Real>::Plan p = planReal( dest->dimX, dest->dimY, false, in, out );
+
+  FFTW<Real>::executeC2R( p, in, out );
+
+  // Scale inverse
+
+  Real scale = 1.0 / (float) n;
+
+  for (int i=0; i<n; i++)
+    dest->a[i] = complex<Real>( out[i] * scale, 0 );
+
+  FFTW<Real>::free( in );
+  FFTW<Real>::free( out );
+}
+
+
+
+// A few bands per thread, so that uneven bands (e.g. ones crossing
+// many grid lines in step 6) balance over the pool
+
+template <class Real>
+int BasicCompute<Real>::columnBands( int x0, int x1 )
+
+{
+  int bands = 4 * pool->size();
+
+  if (bands > x1 - x0)
+    bands = max( x1 - x0, 0 );
+
+  return bands;
+}
+
+
+template <class Real>
+void BasicCompute<Real>::forColumnBands( int x0, int x1, const std::function<void(int,int,int)> &f )
+
+{
+  int bands = columnBands( x0, x1 );
+  int n = x1 - x0;
+
+  pool->parallelFor( bands, [&]( int b ) {
+    f( b, x0 + n * b / bands, x0 + n * (b+1) / bands );
+  } );
+}
+
+
+
+// The two precisions; see compute.h for single precision
+
+template class BasicCompute<double>;
+
+#ifdef COMPUTE_SINGLE_PRECISION
+template class BasicCompute<float>;
+#endif
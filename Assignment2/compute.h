@@ -7,59 +7,97 @@
 #include "headers.h"
 #include "texture.h"
 
+#include "fft.h"
+#include "threadpool.h"
+#include "trace.h"
+
 #include <complex>
-#include <fftw3.h>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
 
 
 typedef enum { TRANSLATE, ROTATE, SCALE, INTENSITY } EditMode;
 typedef enum { FORWARD, BACKWARD } ProjectionMode;
+typedef enum { PERPENDICULAR_FILL, DISTANCE_FILL } GridFill;
+typedef enum { MEDIAN_ESTIMATOR, HISTOGRAM_ESTIMATOR } LineEstimator;
+typedef enum { SPATIAL_REMOVAL, NOTCH_REMOVAL } GridRemoval;
 
 
 
-// A 2D array of complex numbers
+// A 2D array of complex numbers, of precision 'Real' (float or double).
+//
+// The elements are allocated with FFTW's allocator, so they are aligned
+// for its SIMD code, and are freed with the array.  Arrays can be moved
+// but not copied.
 
-class ComplexArray2D {
+template <class Real>
+class BasicComplexArray2D {
 
  public:
 
-  complex<double> *a;  // stored in row-major order
+  complex<Real> *a;  // stored in row-major order
 
   int dimX, dimY;
 
-  ComplexArray2D() {
+  BasicComplexArray2D() {
     a = NULL;
+    dimX = dimY = 0;
   }
 
-  ComplexArray2D( int _dimX, int _dimY ) {
+  BasicComplexArray2D( int _dimX, int _dimY ) {
 
     dimX = _dimX;
     dimY = _dimY;
 
-    a = new complex<double>[ dimX * dimY ];
+    allocate();
   }
 
   // Use the 'r' channel from a texture to initialize the array
   
-  ComplexArray2D( Texture *t ) {
+  BasicComplexArray2D( Texture *t ) {
 
     dimX = t->width;
     dimY = t->height;
 
-    a = new complex<double>[ dimX * dimY ];
+    allocate();
 
     for (int x=0; x<dimX; x++)
       for (int y=0; y<dimY; y++)
-	(*this)(x,y) = complex<double>( t->pixel(x,y).r, 0 );
+	(*this)(x,y) = complex<Real>( t->pixel(x,y).r, 0 );
+  }
+
+  BasicComplexArray2D( BasicComplexArray2D &&other ) {
+    a = other.a;
+    dimX = other.dimX;
+    dimY = other.dimY;
+    other.a = NULL;
+    other.dimX = other.dimY = 0;
+  }
+
+  BasicComplexArray2D &operator=( BasicComplexArray2D &&other ) {
+    if (this != &other) {
+      FFTW<Real>::free( a );
+      a = other.a;
+      dimX = other.dimX;
+      dimY = other.dimY;
+      other.a = NULL;
+      other.dimX = other.dimY = 0;
+    }
+    return *this;
   }
 
-  ~ComplexArray2D() {
+  BasicComplexArray2D( const BasicComplexArray2D & ) = delete;
+  BasicComplexArray2D &operator=( const BasicComplexArray2D & ) = delete;
+
+  ~BasicComplexArray2D() {
     if (a != NULL)
-      delete [] a;
+      FFTW<Real>::free( a );
   }
 
   // Reference elements as a(x,y)
   
-  complex<double> & operator()( int x, int y ) {
+  complex<Real> & operator()( int x, int y ) {
     return a[ x + dimX * y];
   }
 
@@ -67,13 +105,26 @@ class ComplexArray2D {
 
   void scale( double factor ) {
 
-    complex<double>* p = a;
+    complex<Real>* p = a;
 
     for (int i=0; i<dimX*dimY; i++)
-      *p++ *= factor;
+      *p++ *= (Real) factor;
+  }
+
+ private:
+
+  // Storage for dimX x dimY elements, all zero
+
+  void allocate() {
+    a = (complex<Real> *) FFTW<Real>::malloc( dimX * dimY * sizeof(complex<Real>) );
+    for (int i=0; i<dimX*dimY; i++)
+      a[i] = 0;
   }
 };
 
+typedef BasicComplexArray2D<double> ComplexArray2D;
+typedef BasicComplexArray2D<float>  ComplexArray2Df;
+
 
 
 // Represent the positions of peaks in the Fourier spectrum in polar
@@ -114,43 +165,360 @@ public:
 
 
 
-class Compute {
+// The 'capacity' strongest of the peaks offered to it, by squared
+// magnitude.  The peaks are kept in a min-heap, so the weakest is
+// replaced in O(log capacity) when a stronger one arrives.  Equal
+// magnitudes are ordered by position, so the peaks kept don't depend
+// on the order in which they were offered.
+
+class StrongestPeaks {
+
+  class Peak {
+   public:
+    float mag2;
+    ArrayPos pos;
+    Peak( float m, ArrayPos p ) { mag2 = m; pos = p; }
+  };
+
+  // "a is stronger than b": the heap order that puts the weakest first
+
+  static bool stronger( const Peak &a, const Peak &b ) {
+    if (a.mag2 != b.mag2) return a.mag2 > b.mag2;
+    if (a.pos.x != b.pos.x) return a.pos.x < b.pos.x;
+    return a.pos.y < b.pos.y;
+  }
+
+  std::vector<Peak> heap;
+
+ public:
+
+  unsigned int capacity;
+
+  StrongestPeaks( unsigned int _capacity ) {
+    capacity = _capacity;
+  }
+
+  void offer( float mag2, int x, int y ) {
+
+    Peak p( mag2, ArrayPos( x, y ) );
+
+    if (heap.size() < capacity) {
+      heap.push_back( p );
+      std::push_heap( heap.begin(), heap.end(), stronger );
+    } else if (capacity > 0 && stronger( p, heap.front() )) {
+      std::pop_heap( heap.begin(), heap.end(), stronger );
+      heap.back() = p;
+      std::push_heap( heap.begin(), heap.end(), stronger );
+    }
+  }
+
+  void merge( StrongestPeaks &other ) {
+    for (unsigned int i=0; i<other.heap.size(); i++)
+      offer( other.heap[i].mag2, other.heap[i].pos.x, other.heap[i].pos.y );
+  }
+
+  unsigned int size() {
+    return heap.size();
+  }
+
+  // The peaks kept, in no particular order
+
+  ArrayPos position( int i ) {
+    return heap[i].pos;
+  }
+};
+
+
+
+// Grid removal at precision 'Real'.  Compute works in double
+// precision and ComputeF in single precision, which is plenty for grid
+// detection and halves the memory traffic of every stage.  ComputeF
+// needs FFTW's single-precision library (-lfftw3f), so compute.cpp
+// only builds it with -DCOMPUTE_SINGLE_PRECISION, as the batch tool
+// does; the viewer uses Compute alone.
+//
+// The FT of a real image is Hermitian: F(-u,-v) = conj( F(u,v) ).  With
+// 'realFFT' set, 'imageFT' and 'gridFT' hold only the half spectrum
+// that FFTW's r2c transform produces, columns 0 to dimX/2, and the
+// other columns are implied.  spectrum() reads either layout as a
+// full dimX x dimY spectrum.  'realFFT' is off unless the constructor
+// is asked for it, since the viewer transforms and displays 'imageFT'
+// and 'gridFT' as full dimX x dimY arrays; the batch tool turns it on.
+//
+// The FFTs and the scans of computeSolution() run on the Compute's own
+// 'numThreads()' threads.  The scans split the columns into bands and
+// merge the bands' results in order, so the output doesn't depend on
+// the number of threads.
+
+template <class Real>
+class BasicCompute {
 
  public:
 
+  typedef BasicComplexArray2D<Real> Array;
+
   int dimX, dimY;
 
-  ComplexArray2D *image;      // original image
-  ComplexArray2D *imageFT;    // FT of original image
-  ComplexArray2D *grid;       // grid image
-  ComplexArray2D *gridFT;     // FT of grid image
-  ComplexArray2D *result;     // original with grid subtracted
+  bool realFFT;               // FTs are half spectra from real-data transforms; fixed at construction
+
+  Array *image;               // original image
+  Array *imageFT;             // FT of original image
+  Array *grid;                // grid image; NULL if made for NOTCH_REMOVAL, until SPATIAL_REMOVAL is used
+  Array *gridFT;              // FT of grid image; likewise
+  Array *result;              // original with grid subtracted
 
   float gridLineMagnitudeThreshold = 16;  // min magnitude in grid image for a pixel to be on a grid line
 
   bool interpolateAroundGridLines = true; // when removing grid lines, fill them with surrounding pixels
 
+  GridFill gridFill = PERPENDICULAR_FILL; // fill from up to 2 pixels either side of the line, or from the nearest
+                                          // pixel off any line (for lines too wide for that)
+
   float thresholdPercentage = 0.40;       // percentage of max magnitude above which peaks are detected
 
-  Compute( Texture *t ) {
+  // SPATIAL_REMOVAL finds the grid lines in 'grid', the inverse FT of
+  // the peaks, and fills them from the pixels around them.
+  // NOTCH_REMOVAL instead takes the peaks out of 'imageFT' with smooth
+  // notches, 'notchWidth' wide, and inverts that: one inverse FT and no
+  // 'grid', 'gridFT' or filling.  Only 'result' and 'colourResult'
+  // differ.
 
-    image = new ComplexArray2D( t ); // input image
+  GridRemoval gridRemoval = SPATIAL_REMOVAL;
 
-    dimX = t->width;
-    dimY = t->height;
+  float notchWidth = 1.5;                 // standard deviation of each notch, in FT elements
+
+  unsigned int maxPeaks = 4096;           // number of strongest peaks used to find the grid lines
+
+  float *squaredMagnitudes;   // |imageFT|^2, cached by computeSolution(); 0 in row 0 and column 0, which aren't scanned
+
+  PolarPeak lines[2];         // (angle,distance) in the FT of the two grid line directions
+
+  LineEstimator lineEstimator = MEDIAN_ESTIMATOR; // how step 4 finds 'lines' from the peaks
+
+  float lineConfidence[2] = { -1, -1 }; // 0 to 1 for each of 'lines' from HISTOGRAM_ESTIMATOR, else -1
+
+  bool colour;                // 'image' is the luminance of 'colourImage'
+  unsigned char *colourImage; // RGB, 3 bytes per pixel, row-major; NULL until loadColourImage()
+  unsigned char *colourResult; // 'colourImage' with the grid removed
+
+  // The stages of computeSolution(), in order
+
+  typedef enum { FORWARD_FT, MAXIMUM, PEAKS, LINES, GRID, RESULT, NUM_STAGES } Stage;
+
+  bool printLines = true;                 // computeSolution() reports the grid lines, or their absence
+
+  // If set, computeSolution() records the time of each stage and FFT
+  // plan lookup, and counts the peaks, grid-line pixels and the fills
+  // that found no pixel to fill from, in 'trace'
+
+  Trace *trace = NULL;
+
+  // If 'fixedLines', step 4 is skipped and 'lines' are whatever the
+  // caller set; call invalidate( LINES ) after changing them
+
+  bool fixedLines = false;
+
+  // 'threads' is 0 to use one thread per core.  'removal' sets
+  // 'gridRemoval'; for NOTCH_REMOVAL, 'grid' and 'gridFT' aren't
+  // allocated unless 'gridRemoval' is later changed.
+
+  BasicCompute( Texture *t, bool useRealFFT = false, int threads = 0, GridRemoval removal = SPATIAL_REMOVAL )
+    : BasicCompute( t->width, t->height, useRealFFT, threads, removal ) {
 
-    imageFT = new ComplexArray2D( dimX, dimY );
-    grid    = new ComplexArray2D( dimX, dimY );
-    gridFT  = new ComplexArray2D( dimX, dimY );
-    result  = new ComplexArray2D( dimX, dimY );
+    *image = Array( t ); // input image
   }
 
-  void computeSolution();
+  // A workspace for dimX x dimY images, which are given with
+  // loadImage().  It can be reused for any number of them.
 
-  void forwardFT( ComplexArray2D *src, ComplexArray2D *dest );
-  void inverseFT( ComplexArray2D *src, ComplexArray2D *dest );
+  BasicCompute( int _dimX, int _dimY, bool useRealFFT = false, int threads = 0,
+                GridRemoval removal = SPATIAL_REMOVAL ) {
 
-  float averageOfNeighbours( int x, int y, ComplexArray2D *image, ComplexArray2D *grid, PolarPeak (&lines)[2] );
+    FFTPlanCache<Real>::instance(); // before the first FFTW allocation
+
+    pool = new ThreadPool( threads );
+
+    dimX = _dimX;
+    dimY = _dimY;
+
+    image = new Array( dimX, dimY );
+
+    colour = false;
+    colourImage = colourResult = NULL;
+
+    realFFT = useRealFFT;
+
+    int spectrumX = realFFT ? dimX/2 + 1 : dimX;
+
+    imageFT = new Array( spectrumX, dimY );
+    result  = new Array( dimX, dimY );
+
+    gridRemoval = removal;
+
+    grid = gridFT = NULL;
+    if (gridRemoval == SPATIAL_REMOVAL)
+      allocateGrid();
+
+    squaredMagnitudes = new float[ spectrumX * (size_t) dimY ](); // zeroed
+
+    maskWords = (dimX + 63) / 64;
+    gridMask = new uint64_t[ maskWords * dimY ];
+
+    for (int s=0; s<NUM_STAGES; s++)
+      valid[s] = false;
+  }
+
+  BasicCompute( const BasicCompute & ) = delete;
+  BasicCompute &operator=( const BasicCompute & ) = delete;
+
+  ~BasicCompute() {
+    delete image;
+    delete imageFT;
+    delete grid;
+    delete gridFT;
+    delete result;
+    delete [] squaredMagnitudes;
+    delete [] gridMask;
+    delete [] colourImage;
+    delete [] colourResult;
+    delete pool;
+  }
+
+  int numThreads() {
+    return pool->size();
+  }
+
+  void setNumThreads( int threads ) {
+    delete pool;
+    pool = new ThreadPool( threads );
+  }
+
+  bool computeSolution();      // false if the grid lines couldn't be found
+
+  // Copy a dimX x dimY image into 'image': element (x,y) is
+  // values[ x*step + y*rowStep ], so 'step' is 1 for a grey image or 3
+  // to take the red channel of an RGB image.  'rowStep' defaults to
+  // dimX*step; a larger one reads a window of a bigger image.
+
+  void loadImage( const unsigned char *values, int step, int rowStep = 0 );
+
+  // Copy a dimX x dimY colour image: pixel (x,y) is the red, green and
+  // blue bytes at rgb[ x*step + y*rowStep ].  The grid is found from its
+  // luminance, which goes in 'image', and is removed from all three
+  // channels into 'colourResult' as well as from 'image' into 'result'.
+
+  void loadColourImage( const unsigned char *rgb, int step, int rowStep = 0 );
+
+  // Grid line 'g' (0 or 1) in the image, from 'lines': the angle of its
+  // normal in degrees and the distance between lines in pixels
+
+  void gridLine( int g, float &angle, float &wavelength );
+
+  // Make the next computeSolution() rerun 'stage' and everything
+  // downstream of it
+
+  void invalidate( Stage stage );
+
+  void imageChanged() {
+    invalidate( FORWARD_FT );
+  }
+
+  void forwardFT( Array *src, Array *dest );
+  void inverseFT( Array *src, Array *dest );
+
+  // As above, but for real data: the imaginary parts of 'src' are
+  // ignored and 'dest' is a half spectrum, or the reverse
+
+  void forwardRealFT( Array *src, Array *dest );
+  void inverseRealFT( Array *src, Array *dest );
+
+  // Element (x,y) of the full spectrum stored in 'ft'
+
+  complex<Real> spectrum( Array *ft, int x, int y ) {
+    if (!realFFT || x <= dimX/2)
+      return (*ft)( x, y );
+    return conj( (*ft)( dimX - x, (dimY - y) % dimY ) );
+  }
+
+  float averageOfNeighbours( int x, int y, Array *image, Array *grid, PolarPeak (&lines)[2] );
+
+  // A result value as an 8-bit sample: rounded to nearest, halves to
+  // even, and clamped to [0,255].  Grey results (from 'result') and
+  // 'colourResult' are both rounded with this, so a colour image with
+  // R = G = B comes out as the grey image does.
+
+  static unsigned char toSample( float v ) {
+    return (unsigned char) (v < 0 ? 0 : v > 255 ? 255 : rint( v ));
+  }
+
+ private:
+
+  ThreadPool *pool;
+
+  // Stage state kept between calls of computeSolution()
+
+  bool valid[NUM_STAGES];               // stage is up to date
+
+  float maxMag2;                        // from MAXIMUM
+  vector<ArrayPos> peakPositions;       // from PEAKS
+  float minKeptMag2, maxRejectedMag2;   // weakest component above and strongest below the threshold
+
+  float peaksThresholdPercentage;       // parameters the stages last ran with
+  unsigned int peaksMaxPeaks;
+  float resultMagnitudeThreshold;
+  bool resultInterpolate;
+  LineEstimator linesEstimator;
+  GridFill resultGridFill;
+  GridRemoval peaksGridRemoval;
+  GridRemoval resultGridRemoval;
+  float resultNotchWidth;
+
+  std::atomic<long long> failedFills;   // while tracing, in RESULT
+
+  uint64_t *gridMask;                   // grid-line pixels of 'grid', one bit each, from RESULT
+  int maskWords;                        // words per row of 'gridMask'
+
+  bool gridMasked( int x, int y ) {
+    return (gridMask[ y * (size_t) maskWords + (x >> 6) ] >> (x & 63)) & 1;
+  }
+
+  void transformImage();                // the stages
+  void findMaximum();
+  void findPeaks();
+  bool findLines();                     // false if too few peaks were found
+  bool findLinesFromHistograms();
+  void transformGrid();
+  void removeGrid();
+  void notchFilter();                   // removeGrid() for NOTCH_REMOVAL
+  void allocateGrid();
+  void buildGridMask();                 // parts of removeGrid()
+  void perpendicularFill();
+  void distanceFill();
+  void copyPixels( size_t i, int n );
+  void fillPixel( size_t i, int64_t a, int64_t b );
+  void reportLines();
+
+  // Split columns [x0,x1) into columnBands() bands and call f( band,
+  // bandX0, bandX1 ) for each on the thread pool
+
+  int columnBands( int x0, int x1 );
+  void forColumnBands( int x0, int x1, const std::function<void(int,int,int)> &f );
+
+  // Plans from the FFTPlanCache for 'numThreads()' threads, with the
+  // lookup (or planning) timed in 'trace'
+
+  typename FFTW<Real>::Plan plan( int x, int y, int sign, void *in, void *out ) {
+    TraceScope s( trace, "FFT plan" );
+    return FFTPlanCache<Real>::instance().plan( x, y, sign, in, out, numThreads() );
+  }
+
+  typename FFTW<Real>::Plan planReal( int x, int y, bool forward, void *in, void *out ) {
+    TraceScope s( trace, "FFT plan" );
+    return FFTPlanCache<Real>::instance().planReal( x, y, forward, in, out, numThreads() );
+  }
 };
 
+typedef BasicCompute<double> Compute;
+typedef BasicCompute<float>  ComputeF;
+
 #endif
@@ -0,0 +1,268 @@
+// fft.h
+
+
+#ifndef FFT_H
+#define FFT_H
+
+#include "headers.h"
+
+#include <complex>
+#include <map>
+#include <mutex>
+#include <string>
+#include <fftw3.h>
+
+
+typedef enum { COMPLEX_DFT, REAL_TO_COMPLEX, COMPLEX_TO_REAL } TransformKind;
+
+
+// The FFTW interface for one precision: FFTW<double> calls the fftw_*
+// functions and FFTW<float> the fftwf_* ones, so that code templated
+// on the precision can call either.
+//
+// FFTW's multi-threaded transforms need its threads libraries
+// (-lfftw3_threads, and -lfftw3f_threads for single precision), so
+// they are only used in a build with -DFFTW_THREADS.  Otherwise each
+// transform runs on one thread and initThreads() reports that.
+
+template <class Real> class FFTW;
+
+template <> class FFTW<double> {
+
+ public:
+
+  typedef fftw_plan Plan;
+  typedef fftw_complex Complex;
+
+  static const char *wisdomFile() { return "fftw.wisdom"; }
+
+  static void *malloc( size_t bytes ) { return fftw_malloc( bytes ); }
+  static void free( void *p )         { fftw_free( p ); }
+  static int alignmentOf( void *p )   { return fftw_alignment_of( (double *) p ); }
+
+  static Plan planDFT( int n0, int n1, Complex *in, Complex *out, int sign, unsigned int flags ) {
+    return fftw_plan_dft_2d( n0, n1, in, out, sign, flags );
+  }
+  static Plan planR2C( int n0, int n1, double *in, Complex *out, unsigned int flags ) {
+    return fftw_plan_dft_r2c_2d( n0, n1, in, out, flags );
+  }
+  static Plan planC2R( int n0, int n1, Complex *in, double *out, unsigned int flags ) {
+    return fftw_plan_dft_c2r_2d( n0, n1, in, out, flags );
+  }
+
+  static void executeDFT( Plan p, Complex *in, Complex *out ) { fftw_execute_dft( p, in, out ); }
+  static void executeR2C( Plan p, double *in, Complex *out )  { fftw_execute_dft_r2c( p, in, out ); }
+  static void executeC2R( Plan p, Complex *in, double *out )  { fftw_execute_dft_c2r( p, in, out ); }
+  static void destroy( Plan p )                               { fftw_destroy_plan( p ); }
+
+  static int importWisdom( const char *file ) { return fftw_import_wisdom_from_filename( file ); }
+  static int exportWisdom( const char *file ) { return fftw_export_wisdom_to_filename( file ); }
+
+#ifdef FFTW_THREADS
+  static int initThreads()               { return fftw_init_threads(); }
+  static void planWithThreads( int n )   { fftw_plan_with_nthreads( n ); }
+#else
+  static int initThreads()               { return 0; }
+  static void planWithThreads( int )     {}
+#endif
+};
+
+template <> class FFTW<float> {
+
+ public:
+
+  typedef fftwf_plan Plan;
+  typedef fftwf_complex Complex;
+
+  static const char *wisdomFile() { return "fftwf.wisdom"; }
+
+  static void *malloc( size_t bytes ) { return fftwf_malloc( bytes ); }
+  static void free( void *p )         { fftwf_free( p ); }
+  static int alignmentOf( void *p )   { return fftwf_alignment_of( (float *) p ); }
+
+  static Plan planDFT( int n0, int n1, Complex *in, Complex *out, int sign, unsigned int flags ) {
+    return fftwf_plan_dft_2d( n0, n1, in, out, sign, flags );
+  }
+  static Plan planR2C( int n0, int n1, float *in, Complex *out, unsigned int flags ) {
+    return fftwf_plan_dft_r2c_2d( n0, n1, in, out, flags );
+  }
+  static Plan planC2R( int n0, int n1, Complex *in, float *out, unsigned int flags ) {
+    return fftwf_plan_dft_c2r_2d( n0, n1, in, out, flags );
+  }
+
+  static void executeDFT( Plan p, Complex *in, Complex *out ) { fftwf_execute_dft( p, in, out ); }
+  static void executeR2C( Plan p, float *in, Complex *out )   { fftwf_execute_dft_r2c( p, in, out ); }
+  static void executeC2R( Plan p, Complex *in, float *out )   { fftwf_execute_dft_c2r( p, in, out ); }
+  static void destroy( Plan p )                               { fftwf_destroy_plan( p ); }
+
+  static int importWisdom( const char *file ) { return fftwf_import_wisdom_from_filename( file ); }
+  static int exportWisdom( const char *file ) { return fftwf_export_wisdom_to_filename( file ); }
+
+#ifdef FFTW_THREADS
+  static int initThreads()               { return fftwf_init_threads(); }
+  static void planWithThreads( int n )   { fftwf_plan_with_nthreads( n ); }
+#else
+  static int initThreads()               { return 0; }
+  static void planWithThreads( int )     {}
+#endif
+};
+
+
+
+// A cache of FFTW plans of one precision, shared by all Compute
+// objects of that precision.
+//
+// Plans are made once for each combination of transform kind, array
+// dimensions, direction, in-place or not, whether the arrays are
+// SIMD-aligned and the number of threads the transform uses, then
+// reused with executeDFT() (or the r2c and c2r equivalents) on
+// whatever arrays are passed.  They are made on scratch arrays, so
+// that FFTW_MEASURE and FFTW_PATIENT (which overwrite the arrays while
+// timing) don't destroy the caller's data.
+//
+// FFTW's accumulated "wisdom" is loaded from 'wisdomFile' when the
+// cache is first used and saved again whenever a new plan is made, so
+// later runs at the same resolution get their plans without measuring.
+// Each precision has its own wisdom.
+
+template <class Real>
+class FFTPlanCache {
+
+  typedef typename FFTW<Real>::Plan Plan;
+  typedef typename FFTW<Real>::Complex Complex;
+
+  class PlanKey {
+   public:
+    TransformKind kind;
+    int dimX, dimY, sign;
+    bool inPlace, aligned;
+    int threads;
+
+    PlanKey( TransformKind k, int x, int y, int s, bool ip, bool al, int t ) {
+      kind = k;
+      dimX = x;  dimY = y;  sign = s;
+      inPlace = ip;  aligned = al;
+      threads = t;
+    }
+
+    bool operator<( const PlanKey &k ) const {
+      if (kind != k.kind) return kind < k.kind;
+      if (dimX != k.dimX) return dimX < k.dimX;
+      if (dimY != k.dimY) return dimY < k.dimY;
+      if (sign != k.sign) return sign < k.sign;
+      if (inPlace != k.inPlace) return inPlace < k.inPlace;
+      if (aligned != k.aligned) return aligned < k.aligned;
+      return threads < k.threads;
+    }
+  };
+
+  std::map<PlanKey,Plan> plans;
+  std::mutex lock;              // the FFTW planner is not thread-safe
+  bool wisdomLoaded;
+  bool threadsAvailable;        // FFTW's threads library initialized
+
+  FFTPlanCache() {
+    plannerFlags = FFTW_MEASURE;
+    wisdomFile = FFTW<Real>::wisdomFile();
+    wisdomLoaded = false;
+    threadsAvailable = (FFTW<Real>::initThreads() != 0); // FFTW wants this first; see instance()
+  }
+
+  Plan findPlan( PlanKey key ) {
+
+    std::lock_guard<std::mutex> l( lock );
+
+    if (!wisdomLoaded) {
+      if (wisdomFile != "")
+        FFTW<Real>::importWisdom( wisdomFile.c_str() ); // fails harmlessly if there is no file yet
+      wisdomLoaded = true;
+    }
+
+    typename std::map<PlanKey,Plan>::iterator i = plans.find( key );
+    if (i != plans.end())
+      return i->second;
+
+    // Plan on scratch arrays, big enough for the complex data of any
+    // kind.  FFTW's allocations are aligned, so a plan for unaligned
+    // arrays must say so.
+
+    int dimX = key.dimX;
+    int dimY = key.dimY;
+    int n = dimX * dimY;
+
+    unsigned int flags = plannerFlags | (key.aligned ? 0 : FFTW_UNALIGNED);
+
+    Complex *scratchIn  = (Complex *) FFTW<Real>::malloc( n * sizeof(Complex) );
+    Complex *scratchOut = key.inPlace ? scratchIn : (Complex *) FFTW<Real>::malloc( n * sizeof(Complex) );
+
+    if (threadsAvailable)
+      FFTW<Real>::planWithThreads( key.threads );
+
+    Plan p;
+
+    if (key.kind == REAL_TO_COMPLEX)
+      p = FFTW<Real>::planR2C( dimY, dimX, (Real *) scratchIn, scratchOut, flags );
+    else if (key.kind == COMPLEX_TO_REAL)
+      p = FFTW<Real>::planC2R( dimY, dimX, scratchIn, (Real *) scratchOut, flags );
+    else
+      p = FFTW<Real>::planDFT( dimY, dimX, // dimY, then dimX is the correct order
+                               scratchIn, scratchOut, key.sign, flags );
+
+    FFTW<Real>::free( scratchIn );
+    if (!key.inPlace)
+      FFTW<Real>::free( scratchOut );
+
+    if (p == NULL) {
+      cerr << "FFTW could not make a " << dimX << " x " << dimY << " plan" << endl;
+      exit(1);
+    }
+
+    plans[ key ] = p;
+
+    if (wisdomFile != "")
+      FFTW<Real>::exportWisdom( wisdomFile.c_str() );
+
+    return p;
+  }
+
+ public:
+
+  unsigned int plannerFlags;    // FFTW_ESTIMATE, FFTW_MEASURE or FFTW_PATIENT
+  std::string wisdomFile;       // "" to neither load nor save wisdom
+
+  // The cache, made on first use.  Compute's constructors call this
+  // before allocating any arrays, so that FFTW's threads are set up
+  // before any other FFTW call of this precision.
+
+  static FFTPlanCache &instance() {
+    static FFTPlanCache cache;
+    return cache;
+  }
+
+  ~FFTPlanCache() {
+    for (typename std::map<PlanKey,Plan>::iterator i=plans.begin(); i!=plans.end(); i++)
+      FFTW<Real>::destroy( i->second );
+  }
+
+  // A plan for a dimX x dimY transform from 'in' to 'out', in direction
+  // 'sign' (FFTW_FORWARD or FFTW_BACKWARD), run on 'threads' threads.
+  // Run it with FFTW<Real>::executeDFT( plan, in, out ).
+
+  Plan plan( int dimX, int dimY, int sign, void *in, void *out, int threads = 1 ) {
+    bool aligned = (FFTW<Real>::alignmentOf( in ) == 0 && FFTW<Real>::alignmentOf( out ) == 0);
+    return findPlan( PlanKey( COMPLEX_DFT, dimX, dimY, sign, in == out, aligned, threads ) );
+  }
+
+  // A plan for the real-to-complex transform of a dimX x dimY real
+  // array 'in' to the (dimX/2+1) x dimY half spectrum 'out' if
+  // 'forward', or for the complex-to-real transform back if not.  The
+  // arrays must not overlap.  Run it with executeR2C() or executeC2R().
+
+  Plan planReal( int dimX, int dimY, bool forward, void *in, void *out, int threads = 1 ) {
+    bool aligned = (FFTW<Real>::alignmentOf( in ) == 0 && FFTW<Real>::alignmentOf( out ) == 0);
+    return findPlan( PlanKey( forward ? REAL_TO_COMPLEX : COMPLEX_TO_REAL, dimX, dimY,
+                              forward ? FFTW_FORWARD : FFTW_BACKWARD, false, aligned, threads ) );
+  }
+};
+
+#endif
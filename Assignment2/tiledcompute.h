@@ -0,0 +1,199 @@
+// tiledcompute.h
+
+
+#ifndef TILEDCOMPUTE_H
+#define TILEDCOMPUTE_H
+
+#include "compute.h"
+
+#include <vector>
+#include <mutex>
+
+
+// Grid removal for scans too large for one whole-image FFT.
+//
+// The directions and spacings of the grid lines are estimated once,
+// from a representative window of up to estimateSize x estimateSize
+// pixels at the centre of the scan.  The scan is then de-gridded in
+// tileSize x tileSize tiles, each processed in a window that reaches
+// 'overlap' pixels beyond the tile on every side (overlap-save): the
+// window's FFT wraps around at the window edges, which disturbs the
+// grid image near them, so only the tile in the middle is kept.  The
+// tiles use the estimated lines rather than finding their own, so
+// tiles with few grid peaks are still filled consistently.
+//
+// All windows are the same size, so each worker reuses one Compute
+// workspace, and one set of FFT plans, for all its tiles.  Peak memory
+// is the 8-bit scan and its cleaned copy plus one tile-sized workspace
+// per thread, rather than five full-size complex arrays.  Tiles run in
+// parallel on 'numThreads()' threads.
+
+template <class Real>
+class TiledCompute {
+
+  typedef BasicCompute<Real> Workspace;
+
+  ThreadPool *pool;
+
+  TiledCompute( const TiledCompute & );    // not copyable
+  TiledCompute &operator=( const TiledCompute & );
+
+  void configure( Workspace *c ) {
+    c->gridLineMagnitudeThreshold = gridLineMagnitudeThreshold;
+    c->interpolateAroundGridLines = interpolateAroundGridLines;
+    c->thresholdPercentage = thresholdPercentage;
+    c->gridRemoval = gridRemoval;
+    c->trace = trace;
+    c->printLines = false;
+  }
+
+ public:
+
+  int width, height;
+
+  bool realFFT;
+
+  int tileSize = 512;         // pixels kept from each window
+  int overlap = 32;           // pixels on each side of a tile that are processed but discarded
+  int estimateSize = 1024;    // size of the window the grid is estimated from
+
+  float gridLineMagnitudeThreshold = 16;  // as in Compute
+  bool interpolateAroundGridLines = true;
+  float thresholdPercentage = 0.40;
+  GridRemoval gridRemoval = SPATIAL_REMOVAL;
+
+  Trace *trace = NULL;        // as in Compute
+
+  float angle[2];             // grid found by computeSolution(), as from Compute::gridLine()
+  float wavelength[2];
+
+  // 'threads' is 0 to use one thread per core
+
+  TiledCompute( int w, int h, bool useRealFFT = false, int threads = 0 ) {
+    width = w;
+    height = h;
+    realFFT = useRealFFT;
+    pool = new ThreadPool( threads );
+  }
+
+  ~TiledCompute() {
+    delete pool;
+  }
+
+  int numThreads() {
+    return pool->size();
+  }
+
+  // Remove the grid from the width x height grey scan 'values' and
+  // store the result in 'cleaned'.  If no grid is found, 'cleaned' is a
+  // copy of 'values' and false is returned.
+
+  bool computeSolution( const unsigned char *values, unsigned char *cleaned ) {
+
+    // Estimate the grid from the central window
+
+    int estW = min( width, estimateSize );
+    int estH = min( height, estimateSize );
+    int estX = (width - estW) / 2;
+    int estY = (height - estH) / 2;
+
+    float freqX[2], freqY[2]; // spatial frequency of each line direction, in cycles per pixel
+
+    bool found;
+
+    {
+      Workspace estimate( estW, estH, realFFT, pool->size(), gridRemoval );
+      configure( &estimate );
+
+      estimate.loadImage( values + estX + estY * (size_t) width, 1, width );
+
+      found = estimate.computeSolution();
+
+      for (int g=0; found && g<2; g++) {
+
+        estimate.gridLine( g, angle[g], wavelength[g] );
+        if (!isfinite( wavelength[g] ) || wavelength[g] <= 0)
+          found = false; // peaks with no spacing between them: noise, not a grid
+
+        PolarPeak &line = estimate.lines[g];
+        freqX[g] = line.dist * cos( line.angle ) / estW;
+        freqY[g] = line.dist * sin( line.angle ) / estH;
+      }
+    }
+
+    if (!found) {
+      memcpy( cleaned, values, width * (size_t) height );
+      return false;
+    }
+
+    // De-grid the tiles
+
+    int winW = min( tileSize + 2*overlap, width );
+    int winH = min( tileSize + 2*overlap, height );
+
+    int tilesX = (width + tileSize-1) / tileSize;
+    int tilesY = (height + tileSize-1) / tileSize;
+
+    std::vector<Workspace *> idle;
+    std::mutex idleLock;
+
+    pool->parallelFor( tilesX * tilesY, [&]( int t ) {
+
+      int x0 = (t % tilesX) * tileSize;
+      int y0 = (t / tilesX) * tileSize;
+      int x1 = min( x0 + tileSize, width );
+      int y1 = min( y0 + tileSize, height );
+
+      // The window around the tile, moved inside the scan at its edges
+
+      int winX = max( 0, min( x0 - overlap, width - winW ) );
+      int winY = max( 0, min( y0 - overlap, height - winH ) );
+
+      Workspace *c = NULL;
+
+      {
+        std::lock_guard<std::mutex> l( idleLock );
+        if (!idle.empty()) {
+          c = idle.back();
+          idle.pop_back();
+        }
+      }
+
+      if (c == NULL) {
+
+        c = new Workspace( winW, winH, realFFT, 1, gridRemoval );
+        configure( c );
+
+        // The estimated lines, in the FT of a window
+
+        c->fixedLines = true;
+        for (int g=0; g<2; g++) {
+          float u = freqX[g] * winW;
+          float v = freqY[g] * winH;
+          float a = atan2( v, u );
+          if (a < 0)
+            a += 2 * M_PI;
+          c->lines[g] = PolarPeak( a, sqrt( u*u + v*v ) );
+        }
+      }
+
+      c->loadImage( values + winX + winY * (size_t) width, 1, width );
+      c->computeSolution();
+
+      for (int y=y0; y<y1; y++)
+        for (int x=x0; x<x1; x++) {
+          cleaned[ x + y * (size_t) width ] = Workspace::toSample( abs( (*c->result)( x - winX, y - winY ) ) );
+        }
+
+      std::lock_guard<std::mutex> l( idleLock );
+      idle.push_back( c );
+    } );
+
+    for (unsigned int i=0; i<idle.size(); i++)
+      delete idle[i];
+
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,228 @@
+// trace.h
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+
+// A record of where the time goes: named spans of time ("events") and
+// named counters.
+//
+// Spans are recorded with a TraceScope, which times the block it is
+// declared in, and counters are added to with count().  A Compute
+// records its stages in the Trace its 'trace' points to, and records
+// nothing when 'trace' is NULL, which costs one test per stage.  One
+// Trace can be shared by any number of Computes on any threads.
+//
+// writeSummary() writes, as JSON, the calls and total and longest
+// times of each span name, and the counter totals.  These are kept as
+// running totals, so a summary takes the same memory however long the
+// run.  writeChromeTrace() writes every span and counter change in the
+// Chrome trace event format, for chrome://tracing or Perfetto; those
+// are only kept if the Trace is made with 'keepEvents'.
+
+class Trace {
+
+  class Event {
+   public:
+    std::string name;
+    char phase;                 // 'X' for a span, 'C' for a counter's new value
+    int thread;
+    double start, duration;     // microseconds since the Trace was made
+    long long value;            // for a counter
+  };
+
+  class Totals {
+   public:
+    long long calls = 0;
+    double total = 0, longest = 0;   // microseconds
+  };
+
+  bool keepEvents;
+  std::vector<Event> events;                 // if 'keepEvents'
+  std::map<std::string,Totals> spans;
+  std::map<std::string,long long> counters;
+  std::map<std::thread::id,int> threads;     // small ids for the trace viewer
+  std::mutex lock;
+
+  std::chrono::steady_clock::time_point origin;
+
+  Trace( const Trace & );                    // not copyable
+  Trace &operator=( const Trace & );
+
+  int threadNumber() {                       // with 'lock' held
+    std::map<std::thread::id,int>::iterator i = threads.find( std::this_thread::get_id() );
+    if (i != threads.end())
+      return i->second;
+    int n = (int) threads.size() + 1;
+    threads[ std::this_thread::get_id() ] = n;
+    return n;
+  }
+
+  static std::string quoted( const std::string &s ) {
+    std::string q = "\"";
+    for (unsigned int i=0; i<s.size(); i++) {
+      if (s[i] == '"' || s[i] == '\\')
+        q += '\\';
+      q += s[i];
+    }
+    return q + "\"";
+  }
+
+ public:
+
+  Trace( bool keepAllEvents = false ) {
+    keepEvents = keepAllEvents;
+    origin = std::chrono::steady_clock::now();
+  }
+
+  // Microseconds since the Trace was made
+
+  double now() {
+    return std::chrono::duration<double,std::micro>( std::chrono::steady_clock::now() - origin ).count();
+  }
+
+  // A span called 'name' on this thread from 'start' to 'end'
+
+  void record( const char *name, double start, double end ) {
+    std::lock_guard<std::mutex> l( lock );
+    Totals &t = spans[ name ];
+    t.calls++;
+    t.total += end - start;
+    t.longest = std::max( t.longest, end - start );
+    if (!keepEvents)
+      return;
+    Event e;
+    e.name = name;
+    e.phase = 'X';
+    e.thread = threadNumber();
+    e.start = start;
+    e.duration = end - start;
+    e.value = 0;
+    events.push_back( e );
+  }
+
+  // Add 'n' to counter 'name'
+
+  void count( const char *name, long long n ) {
+    double t = now();
+    std::lock_guard<std::mutex> l( lock );
+    long long &total = counters[ name ];
+    total += n;
+    if (!keepEvents)
+      return;
+    Event e;
+    e.name = name;
+    e.phase = 'C';
+    e.thread = threadNumber();
+    e.start = t;
+    e.duration = 0;
+    e.value = total;
+    events.push_back( e );
+  }
+
+  long long counter( const char *name ) {
+    std::lock_guard<std::mutex> l( lock );
+    std::map<std::string,long long>::iterator i = counters.find( name );
+    return (i == counters.end()) ? 0 : i->second;
+  }
+
+  // Write the summary or the whole trace to 'filename'.  Each returns
+  // false if the file can't be written.
+
+  bool writeSummary( const std::string &filename ) {
+
+    std::lock_guard<std::mutex> l( lock );
+
+    std::ofstream out( filename.c_str() );
+    if (!out)
+      return false;
+
+    out << std::fixed;
+    out.precision( 3 );
+
+    out << "{" << std::endl << "  \"stages\": {";
+
+    for (std::map<std::string,Totals>::iterator i=spans.begin(); i!=spans.end(); i++)
+      out << (i == spans.begin() ? "" : ",") << std::endl
+          << "    " << quoted( i->first ) << ": { \"calls\": " << i->second.calls
+          << ", \"total_ms\": " << i->second.total / 1000
+          << ", \"max_ms\": " << i->second.longest / 1000 << " }";
+
+    out << std::endl << "  }," << std::endl << "  \"counters\": {";
+
+    for (std::map<std::string,long long>::iterator i=counters.begin(); i!=counters.end(); i++)
+      out << (i == counters.begin() ? "" : ",") << std::endl
+          << "    " << quoted( i->first ) << ": " << i->second;
+
+    out << std::endl << "  }" << std::endl << "}" << std::endl;
+
+    return (bool) out;
+  }
+
+  bool writeChromeTrace( const std::string &filename ) {
+
+    std::lock_guard<std::mutex> l( lock );
+
+    std::ofstream out( filename.c_str() );
+    if (!out)
+      return false;
+
+    out << std::fixed;
+    out.precision( 3 );
+
+    out << "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+
+    for (unsigned int i=0; i<events.size(); i++) {
+      Event &e = events[i];
+      out << (i == 0 ? "" : ",") << std::endl
+          << "  { \"name\": " << quoted( e.name ) << ", \"ph\": \"" << e.phase << "\""
+          << ", \"pid\": 1, \"tid\": " << e.thread << ", \"ts\": " << e.start;
+      if (e.phase == 'X')
+        out << ", \"dur\": " << e.duration << " }";
+      else
+        out << ", \"args\": { \"value\": " << e.value << " } }";
+    }
+
+    out << std::endl << "] }" << std::endl;
+
+    return (bool) out;
+  }
+};
+
+
+// Record the time from here to the end of the enclosing block as a
+// span called 'name', if 'trace' isn't NULL.  'name' must outlive the
+// scope (a string literal, normally).
+
+class TraceScope {
+
+  Trace *trace;
+  const char *name;
+  double start;
+
+ public:
+
+  TraceScope( Trace *t, const char *n ) {
+    trace = t;
+    name = n;
+    if (trace != NULL)
+      start = trace->now();
+  }
+
+  ~TraceScope() {
+    if (trace != NULL)
+      trace->record( name, start, trace->now() );
+  }
+};
+
+#endif